@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "common.h"
+#include "list.h"
+
+/*
+ *  region allocator, objects are carved from chunks of pages by bumping a
+ *  pointer and are given back all at once by arena_reset. An arena has one
+ *  owner and takes no locks
+ */
+
+#define ARENA_ALIGN       8
+#define ARENA_CHUNK_PAGES 1	// default chunk size, see thread_arena
+
+// the descriptor lives in the first chunk, which is kept across resets
+typedef struct arena {
+	list_head_t chunks;
+	addr_t cur;		// next free byte of the last chunk
+	addr_t end;
+	size_t chunk_pages;
+} arena_t;
+
+extern arena_t *arena_create(size_t chunk_pages);
+extern void *arena_alloc(arena_t * arena, size_t size);
+extern void arena_reset(arena_t * arena);
+extern void arena_destroy(arena_t * arena);
+
+// arena of the running thread, created on first use
+extern arena_t *thread_arena();
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef AVLTREE_H
+#define AVLTREE_H
+
+#include "common.h"
+#include "list.h"
+
+/*
+ *  intrusive AVL tree, nodes are embedded in the objects and ordered by a
+ *  compare function of the caller. Lookups walk the tree by hand with
+ *  avl_entry, keys must be unique
+ */
+
+typedef struct avl_node {
+	struct avl_node *left;
+	struct avl_node *right;
+	int height;
+} avl_node_t;
+
+// < 0 if a goes left of b
+typedef int (*avl_cmp_t) (avl_node_t * a, avl_node_t * b);
+
+#define avl_entry(ptr, type, member) container_of(ptr, type, member)
+
+// both return the new root
+extern avl_node_t *avl_insert(avl_node_t * root, avl_node_t * node,
+			      avl_cmp_t cmp);
+extern avl_node_t *avl_remove(avl_node_t * root, avl_node_t * node,
+			      avl_cmp_t cmp);
+
+#endif
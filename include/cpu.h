@@ -30,10 +30,11 @@ typedef struct cpu_state {
 #endif
 
 	list_head_t cpu_list;
-} cpu_state_t;
+} __cacheline_aligned cpu_state_t;
 
+// per-CPU arrays are sized by MAX_CPUS, cpuset by the CPUs found
 #define MAX_CPUS 32
-extern cpu_state_t cpuset[];
+extern cpu_state_t *cpuset;
 
 typedef struct {
 	uint_t cpu_num;
@@ -8,6 +8,7 @@ extern void init_debug(multiboot_t * mboot_ptr);
 extern void print_stack_trace();
 extern void print_cur_status();
 extern void print_memory(void *bp, _u32 lines);
+extern const char *lookup_kernel_symbol(addr_t addr);
 
 void panic(const char *msg, const char *file, _u32 line);
 
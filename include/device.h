@@ -4,6 +4,7 @@
 #include "common.h"
 #include "list.h"
 #include "locking.h"
+#include "mm.h"
 
 #define MAX_DEVICES 32
 
@@ -46,6 +47,8 @@ typedef struct blk_dev {
 	blk_dev_ops_t *ops;
 	mutex_t lock;
 	void *meta;
+	uint_t buf_min;		// buffers kept under memory pressure
+	shrinker_t shrinker;
 } blk_dev_t;
 
 // functions
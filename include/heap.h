@@ -5,28 +5,91 @@
 #include "mm.h"
 #include "paging.h"
 #include "list.h"
+#include "locking.h"
 
-// define kheap size
+// define kheap size, it grows by arenas of at least K_HEAP_GROW
 #define K_HEAP_SIZE   0x100000
+#define K_HEAP_GROW   0x40000
 
-// heap algorithms
+// heap algorithms, selected by number as the preprocessor cannot compare
+// the init function names
 #define HEAP_FB   fb_heap_init
 #define HEAP_FF   ff_heap_init
 #define HEAP_SLAB slab_heap_init
-#define INIT_HEAP HEAP_FB	// build-macro
+#define HEAP_TYPE_FB   1
+#define HEAP_TYPE_FF   2
+#define HEAP_TYPE_SLAB 3
+#define HEAP_TYPE HEAP_TYPE_FB	// build-macro
 
-// features
-#if INIT_HEAP == HEAP_FB || INIT_HEAP == HEAP_FF
+#if HEAP_TYPE == HEAP_TYPE_FB
+#define INIT_HEAP HEAP_FB
+#elif HEAP_TYPE == HEAP_TYPE_FF
+#define INIT_HEAP HEAP_FF
+#else
+#define INIT_HEAP HEAP_SLAB
+#endif
 
-#define HBLK_NUM_P_PG (PAGE_SIZE/sizeof(heap_block_t))
+// features
+#if HEAP_TYPE == HEAP_TYPE_FB || HEAP_TYPE == HEAP_TYPE_FF
 
+// boundary tags, a block starts with this header and ends with a copy of
+// size, so both neighbours of a freed block are found in O(1). The list
+// head is the first word of the payload and only used while the block is
+// free or binned
 typedef struct {
-	addr_t base;
-	size_t size;
+	size_t size;		// whole block, HBLK_USED in bit 0
+	_u32 magic;
 	list_head_t lh;
 } __attribute__ ((packed)) heap_block_t;
 
-#elif INIT_HEAP == HEAP_SLAB
+#define HBLK_USED     0x1
+#define HBLK_MAGIC    0x4B4D4C43
+#define HBLK_CACHED   0x4B4D4343	// freed, waiting in a bin or magazine
+#define HBLK_ALIGN    8
+#define HBLK_HDR      (sizeof(size_t) + sizeof(_u32))
+#define HBLK_OVERHEAD (HBLK_HDR + sizeof(size_t))
+#define HBLK_MIN      ((sizeof(heap_block_t) + sizeof(size_t) + HBLK_ALIGN - 1) \
+		       & ~(HBLK_ALIGN - 1))
+
+// small requests are rounded up to multiples of HEAP_BIN_SIZE, freed blocks
+// of those sizes wait in per-size bins and are reused without any search.
+// Bins are merged back into the free list when best-fit runs out
+#define HEAP_BIN_SHIFT 4
+#define HEAP_BIN_SIZE  (1 << HEAP_BIN_SHIFT)
+#define HEAP_BINS      16
+#define HEAP_BIN_MAX   (HEAP_BINS * HEAP_BIN_SIZE)
+// block size of a binned payload size and bin of a block size
+#define HEAP_BIN_BLOCK(size) ((size) + HEAP_BIN_SIZE)
+#define HEAP_BIN_INDEX(bsize) (((bsize) >> HEAP_BIN_SHIFT) - 2)
+#define HEAP_BINNABLE(bsize) ((bsize) <= HEAP_BIN_BLOCK(HEAP_BIN_MAX) \
+			      && !((bsize) & (HEAP_BIN_SIZE - 1)))
+
+// a run of frames cut into blocks. Its first block follows a used fence
+// word and its last one is followed by a used sentinel header, so blocks
+// never merge across arenas. Arenas added on demand are given back to the
+// frame allocator once they are free as a whole
+typedef struct {
+	list_head_t list;
+	size_t pages;
+} heap_arena_t;
+
+#define ARENA_HDR ((sizeof(heap_arena_t) + sizeof(size_t) + HBLK_ALIGN - 1) \
+		   & ~(HBLK_ALIGN - 1))
+
+// each CPU keeps a magazine of small blocks per bin in front of the kernel
+// heap, the heap lock is only taken to move MAG_BATCH blocks at once
+#define MAG_SIZE  8
+#define MAG_BATCH 4
+
+#elif HEAP_TYPE == HEAP_TYPE_SLAB
+
+#include "slab.h"
+
+// power of 2 size classes from 2^KMALLOC_MIN_SHIFT, larger requests take
+// whole pages
+#define KMALLOC_MIN_SHIFT 5
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_CACHES    (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
 
 #endif // end of features
 
@@ -36,10 +99,15 @@ typedef struct {
 	addr_t start;
 	addr_t end;
 
-#if INIT_HEAP == HEAP_FB || INIT_HEAP == HEAP_FF
-	heap_block_t *free;
-	heap_block_t *res;
-	heap_block_t *avail;
+#if HEAP_TYPE == HEAP_TYPE_FB || HEAP_TYPE == HEAP_TYPE_FF
+	list_head_t free;
+	list_head_t bins[HEAP_BINS];
+	int use_bins;
+	list_head_t arenas;
+	size_t grow_pages;	// 0 for a heap of fixed size
+	rawlock_t lock;		// the depot, magazines are per CPU
+#elif HEAP_TYPE == HEAP_TYPE_SLAB
+	kmem_cache_t *caches[KMALLOC_CACHES];
 #endif
 
 } __attribute__ ((packed)) heap_desc_t;
@@ -50,6 +118,21 @@ int init_heap(heap_desc_t * heap, mmc_t * mp, const char *name, size_t size);
 // init kernel heap
 void init_kheap();
 void *kmalloc(size_t size);
+void *kmalloc_aligned(size_t size, size_t align);
+void *kzalloc(size_t size);
 int kfree(void *p);
+
+// kmalloc call sites are tagged by return address, show_kmalloc_sites()
+// prints the top consumers and objects alive for more than age seconds
+#define HEAP_PROFILE 0		// build-macro: profile kmalloc by call site
+#if HEAP_PROFILE
+void show_kmalloc_sites(uint_t top, uint_t age);
+#endif
+
+// mixed allocation trace on a scratch heap, timed with and without bins
+#define HEAP_BENCH 0		// build-macro: run kmalloc_bench at boot
+#if HEAP_BENCH && HEAP_TYPE == HEAP_TYPE_FB
+void kmalloc_bench();
+#endif
 //--
 #endif
@@ -54,5 +54,6 @@ typedef enum {
 #define LOG_MP          "MP      :"
 #define LOG_DEV         "Device  :"
 #define LOG_BLOCK       "Block   :"
+#define LOG_SWAP        "Swap    :"
 
 #endif
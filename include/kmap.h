@@ -0,0 +1,32 @@
+#ifndef KMAP_H
+#define KMAP_H
+
+#include "common.h"
+#include "paging.h"
+
+/*
+ *  temporary kernel mappings for frames beyond the direct map, all slots
+ *  live in one page table starting from KMAP_BASE
+ *
+ *  |KMAP_BASE       | KMAP_PAGES persistent slots (kmap)
+ *  |KMAP_ATOMIC_BASE| KM_SLOTS_P_CPU slots for each CPU (kmap_atomic)
+ */
+
+#define KMAP_BASE        K_HMEM_END
+#define KMAP_PAGES       (PTE_NUM_P_TBL / 2)
+#define KMAP_ATOMIC_BASE (KMAP_BASE + KMAP_PAGES * PAGE_SIZE)
+#define KM_SLOTS_P_CPU   8
+
+extern void init_kmap();
+
+// persistent mappings, may be shared and kept till the slot is recycled
+extern void *kmap(void *page);
+extern void kunmap(void *vaddr);
+
+// per-CPU mappings, only valid on current processor, no TLB shootdown.
+// Preemption is off until kunmap_atomic
+extern void *kmap_atomic(void *page);
+extern void *kmap_atomic_pfn(_u32 pfn);
+extern void kunmap_atomic(void *vaddr);
+
+#endif
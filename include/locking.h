@@ -3,39 +3,7 @@
 
 #include "common.h"
 #include "task.h"
-
-typedef struct {
-	uint_t rlock;
-} rawlock_t;
-
-#ifdef ARCH_X86_32
-
-static inline uint_t xchg(volatile addr_t * addr, uint_t newval)
-{
-	uint_t result;
-
-	// The + in "+m" denotes a read-modify-write operand.
-	asm volatile ("lock; xchgl %0, %1":
-		      "+m" (*addr), "=a"(result):"1"(newval):"cc");
-	return result;
-}
-
-#endif
-
-static inline void init_rlock(rawlock_t * lk)
-{
-	lk->rlock = 0;
-}
-
-static inline uint_t acquire_rlock(rawlock_t * lk)
-{
-	return xchg(&lk->rlock, 1);
-}
-
-static inline uint_t release_rlock(rawlock_t * lk)
-{
-	return xchg(&lk->rlock, 0);
-}
+#include "rawlock.h"
 
 /*
  *   Spinlock
@@ -72,6 +40,7 @@ typedef struct {
 extern void mutex_init(mutex_t * lock);
 
 extern void mutex_lock(mutex_t * lock);
+extern uint_t mutex_trylock(mutex_t * lock);
 extern void mutex_unlock(mutex_t * lock);
 
 /*
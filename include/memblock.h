@@ -0,0 +1,20 @@
+#ifndef MEMBLOCK_H
+#define MEMBLOCK_H
+
+#include "common.h"
+#include "multiboot.h"
+
+/*
+ *  early allocator, serves boot code before mm_phys is set up. Memory is
+ *  taken from the largest available range between the kernel image and
+ *  K_SPACE_END, which stays identity mapped once paging is on, and is
+ *  never given back. What is left is handed over to mm_phys
+ */
+
+extern void init_memblock(multiboot_t * mbp);
+extern void *memblock_alloc(size_t size, size_t align);
+
+// stop early allocations, [*start, *end) is free for the frame allocator
+extern void memblock_release(addr_t * start, addr_t * end);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "common.h"
 #include "multiboot.h"
+#include "list.h"
+#include "rawlock.h"
 
 // page calculation -
 // PAGE_CONTAIN calculates how many pages needed
@@ -30,6 +32,7 @@ typedef struct {
 
 	_u32 nframes;		// frames managed
 	_u32 nfree;		// available free frames
+	rawlock_t lock;		// meta data and counters, irqsave
 } __attribute__ ((packed)) mmc_t;
 
 extern int INIT_MM(mmc_t * mmcp, void *base, _u32 length);
@@ -54,17 +57,17 @@ typedef struct {
 } __attribute__ ((packed)) addr_range_t;
 
 // this struct is used to save multiboot information before paging mechanism 
-// is started, so we no longer need bootloader
-#define MAX_ARDS_ENT 10
+// is started, so we no longer need bootloader. Entries come from memblock
 typedef struct {
-	_u32 total_memory;
-	_u32 avail_memory;
+	_u32 total_memory;	// in KB
+	_u32 avail_memory;	// in KB
 	_u32 mmap_length;
-	addr_range_t mmap_entries[MAX_ARDS_ENT];
+	addr_range_t *mmap_entries;
 } __attribute__ ((packed)) mem_info_t;
 
 // kenel position defined in link conf
 extern _u8 k_start[];
+extern _u8 k_end[];
 
 extern void show_kernel_pos();
 extern void show_ARDS_from_multiboot(multiboot_t * mbp);
@@ -77,12 +80,90 @@ extern void *get_zeroed_page();
 extern int free_pages(void *page);
 extern int free_page(void *page);
 
+// descriptor of each frame in mm_phys, indexed by frame number
+typedef struct page {
+	_u16 count;		// references, 0 if the frame is free
+	_u8 flags;		// PG_DIRTY...
+	_u8 owner;		// PGO_KERNEL...
+	_u16 nr_ptes;		// present entries if the frame is a page table
+	_u16 swap;		// slot holding a copy of the page, 0 if none
+	struct list_head lru;	// active or inactive list
+	void *mapping;		// page directory of an anonymous page, slab header
+	_u32 index;		// virtual address in the page directory
+} page_t;
+
+// page flags
+#define PG_DIRTY      0x01
+#define PG_REFERENCED 0x02
+#define PG_LRU        0x04
+#define PG_ACTIVE     0x08
+
+// page owners
+#define PGO_FREE    0
+#define PGO_KERNEL  1		// kernel data, page directories
+#define PGO_ANON    2		// user pages
+#define PGO_PGTABLE 3		// page tables from mm_phys
+#define PGO_CACHE   4		// buffer cache
+#define PGO_SLAB    5		// slabs, mapping is the slab header
+#define PGO_MAX     6
+
+extern page_t *phys_to_page(void *phys);
+extern void *page_to_phys(page_t * page);
+extern void set_page_owner(page_t * page, _u8 owner);
+extern size_t nr_pages_owned(_u8 owner);
+extern void show_mem();
+
+// fragmentation of mm_phys
+typedef struct {
+	_u32 nfree;		// free frames
+	_u32 free_runs;		// runs of free frames
+	_u32 largest_run;	// frames of the largest free run
+	_u32 movable;		// allocated frames compaction may migrate
+} frag_info_t;
+
+extern void get_frag_info(frag_info_t * info);
+extern void show_frag_info();
+// move user pages away to make room for npg contiguous frames, it is tried
+// by get_free_pages when no such run is free
+extern int compact_frames(size_t npg);
+
+// reference counts, the frame is freed when the last reference goes away.
+// put_page frees the whole run the frame was allocated with
+extern void get_page(page_t * page);
+extern void put_page(page_t * page);
+
+// caches which give memory back under pressure, count returns objects
+// that could be freed and scan frees up to nr of them. Registered shrinkers
+// are called by reclaim before any page is swapped out
+#define MAX_SHRINKERS 16
+#define SHRINK_RATIO  4		// part of each cache freed by one pass
+
+typedef struct shrinker {
+	uint_t (*count) (struct shrinker *);
+	uint_t (*scan) (struct shrinker *, uint_t nr);
+} shrinker_t;
+
+extern int register_shrinker(shrinker_t * shrinker);
+extern void unregister_shrinker(shrinker_t * shrinker);
+extern uint_t shrink_caches(uint_t nr);
+
+// pre-zeroed frames kept for each processor, refilled by kzerod unless
+// free frames drop below ZPOOL_MIN_FREE
+#define ZPOOL_PAGES    16
+#define ZPOOL_MIN_FREE 256
+extern int kzerod(void *args);
+
 // operations on high memory
 extern void *get_free_pages_high(size_t npg);
 extern void *get_free_page_high();
 extern void *get_zeroed_page_high();
 extern int free_pages_high(void *page);
 extern int free_page_high(void *page);
+#define MAX_HMEM_ZONES 4
+
+// frames above 4GB are only reachable with PAE, by frame number. See
+// get_free_pfn_high() in paging.h
+#define MAX_PFN_ZONES 4
 extern addr_t get_high_mem_start();
 extern inline size_t get_high_mem_len();
 
@@ -94,6 +175,10 @@ extern void get_mem_info_from_multiboot(multiboot_t * mbp, mem_info_t * minfo);
 #define META_ENT_SIZE     (sizeof(_u32))
 #define META_ENT_NUM_P_PG (PAGE_SIZE/META_ENT_SIZE)
 
+#define MM_PAGE_TABLE_OFFPAGE minit_pgtbl_offpage
+extern int MM_PAGE_TABLE_OFFPAGE(mmc_t * mmcp, _u32 * meta, void *frame_base,
+				 _u32 npg);
+
 #define PGCOLOR_MASK 0xFF
 #define PGCOLOR(x) ((x)&(PGCOLOR_MASK))
 #define PGCOLOR_XOR(a, b) ((a)^(b))
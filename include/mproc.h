@@ -70,5 +70,7 @@ extern mp_t mpinfo;
 
 extern void smp_halt_others();
 extern void smp_tick_others();
+extern void smp_flush_tlb_others();
+extern void smp_flush_tlb_check();
 
 #endif
@@ -50,4 +50,11 @@ typedef struct {
 	_u32 type;
 } __attribute__ ((packed)) mmap_entry_t;
 
+typedef struct {
+	_u32 mod_start;
+	_u32 mod_end;
+	_u32 cmdline;
+	_u32 pad;
+} __attribute__ ((packed)) multiboot_module_t;
+
 #endif
@@ -9,9 +9,13 @@
 P             V
   |ffffffff|  4G/32bit
   |        |
-  |yyyyyyyy|  kheap end
+  |fee00000|  LAPIC, IO-APIC
+  |        |
+  |c0000000|  K_HMEM_END, kmap window
   |        |
   |xxxxxxxx|  high memory start
+  |        |
+  |38000000|  K_DMAP_END, direct map ends at most here
 D |        |
 i |01000000|  K_SPACE_END, Physical mem map(mm_phys,kheap)
 r |        |
@@ -24,15 +28,36 @@ p |________|
 
 */
 
-// assum page dirs start from the second page of physical memory
-// the first page is reserved for the NULL pointer
+// kernel page dir is at PGD_BASE followed by boot-time page tables, page
+// dirs of tasks and later page tables are allocated from mm_phys
 #define PGD_BASE         0x00100000
-#define PGD_MAX          5
 #define PGD_IDX_KERNEL   0
 
+// paging modes, PAE has 64-bit entries, the NX bit and reaches frames
+// above 4GB. Its 4 page directories are allocated in a row and indexed as
+// one flat array, so the rest of paging code is shared with 32-bit mode
+#define PAGING_32        0
+#define PAGING_PAE       1
+#define PAGING_MODE      PAGING_32	// build-macro
+
+#if PAGING_MODE == PAGING_PAE
+#define PDE_SHIFT       21
+#define PDE_NUM         2048
+#define PTE_NUM_P_TBL   512
+#else
+#define PDE_SHIFT       22
+#define PDE_NUM         1024
+#define PTE_NUM_P_TBL   1024
+#endif
+
 // get specific entry by virtual address from PageDir and PageTable
-#define PDE_INDEX(addr) (((_u32)(addr)>>22) & 0x3FF)
-#define PTE_INDEX(addr) (((_u32)(addr)>>12) & 0x3FF)
+#define PDE_INDEX(addr) (((_u32)(addr)>>PDE_SHIFT) & (PDE_NUM - 1))
+#define PTE_INDEX(addr) (((_u32)(addr)>>12) & (PTE_NUM_P_TBL - 1))
+#define PDE_ADDR(pde)   ((_u32)(pde) << PDE_SHIFT)
+
+// size of address space covered by a page table
+#define PGDIR_SIZE      (1 << PDE_SHIFT)
+#define PGDIR_ALIGN(addr) (((addr)+PGDIR_SIZE - 1) & ~(PGDIR_SIZE - 1))
 
 // virtual address definition for kernel space
 #define K_SPACE_START	0x0	// equal to PGD_BASE for now
@@ -42,10 +67,43 @@ p |________|
 // high memory start depends on actual physical memory length
 #define K_HMEM_END      0xC0000000
 
+// direct map of physical memory is cut here, frames above are managed as
+// high memory frames and only reachable through kmap
+#define K_DMAP_END      0x38000000
+
 // page entry masks
 #define PAGE_PRESENT    0x1
 #define PAGE_WRITE      0x2
 #define PAGE_USER       0x4
+#define PAGE_ACCESSED   0x20
+#define PAGE_DIRTY      0x40
+#define PAGE_GLOBAL     0x100	// kept in TLB over CR3 reloads if CR4.PGE
+#define PAGE_COW        0x200	// available bit: write-protected shared page
+#define PAGE_SWAP       0x400	// available bit: not-present entry of swap slot
+#if PAGING_MODE == PAGING_PAE
+#define PAGE_NX         0x8000000000000000ULL
+#else
+#define PAGE_NX         0
+#endif
+
+// pages populated by one demand fault, the aligned window around faulting
+// address is mapped at once, 1 disables fault-around (power of 2, <= PTE_NUM_P_TBL)
+#define FAULT_AROUND_PAGES 16	// build-macro
+
+// page fault error code
+#define PF_PRESENT      0x1	// protection violation, not a missing page
+#define PF_WRITE        0x2
+#define PF_USER         0x4
+
+// default page entry flags, kernel pages are identical in all address
+// spaces so they are global and never accessible from user mode
+#define PAGE_KERNEL     (PAGE_PRESENT | PAGE_WRITE | PAGE_GLOBAL)
+#define PAGE_USER_RW    (PAGE_PRESENT | PAGE_WRITE | PAGE_USER)
+
+#define CR0_WP          0x00010000
+#define CR0_PG          0x80000000
+#define CR4_PGE         0x80
+#define CR4_PAE         0x20
 
 /* define page entry as _u32
    detailed members intro of page entry
@@ -59,17 +117,35 @@ typedef struct page {
 	_u32 frame:20;		// Frame address (shifted right 12 bits)
 } page_t;
 */
+#if PAGING_MODE == PAGING_PAE
+typedef _u64 page_entry_t;
+#else
 typedef _u32 page_entry_t;
+#endif
+
+// frame address and flag bits of an entry. PAGE_MASK is an int and sign
+// extends into the high half of PAE entries, keeping NX with the address
+#if PAGING_MODE == PAGING_PAE
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+#else
+#define PTE_ADDR_MASK   PAGE_MASK
+#endif
+#define PTE_FLAGS_MASK  (~PTE_ADDR_MASK)
 
 typedef struct {
-	page_entry_t pages[1024];
+	page_entry_t pages[PTE_NUM_P_TBL];
 } __attribute__ ((packed)) page_table_t;
 
 typedef struct {
    /**
-      Array of pointers to pagetables.
+      Array of pagetables, physical address with PDE flags.
    **/
-	page_table_t *tables[1024];
+	page_entry_t tables[PDE_NUM];
+#if PAGING_MODE == PAGING_PAE
+	// loaded into CR3, each entry points to one page of tables
+	_u64 pdpt[4];
+	_u8 pad[PAGE_SIZE - 4 * sizeof(_u64)];
+#endif
    /**
       Array of pointers to the pagetables above, but gives their *physical*
       location, for loading into the CR3 register.
@@ -83,22 +159,79 @@ typedef struct {
 	//_u32 phy_addr;
 } __attribute__ ((packed)) page_directory_t;
 
+#define PGD_PAGES (sizeof(page_directory_t) / PAGE_SIZE)
+
 extern page_directory_t *k_pdir;
+
+// PAGE_NX if the processor supports it, kernel data mappings carry it
+extern page_entry_t page_nx;
 extern void init_paging();
 
 extern void switch_page_directory(page_directory_t * dir);
+extern void load_page_directory(page_directory_t * dir);
 extern void copy_page_directory_from(void *src, void *dst);
+extern page_directory_t *get_curr_page_directory();
+extern page_entry_t *get_page_entry(void *virt_addr, page_directory_t * pdir);
 
-// map virtual address to physical address and unmap virtual address
+// page directories of tasks, kernel space is shared with k_pdir
+extern page_directory_t *alloc_page_directory();
+extern void free_page_directory(page_directory_t * pdir);
+
+// share user pages of src with dst as copy-on-write
+extern int copy_address_space(page_directory_t * src, page_directory_t * dst);
+
+// map virtual address to physical address and unmap virtual address,
+// missing page tables are allocated from mp at boot time or from mm_phys if
+// mp is NULL
 extern int page_map(void *virt_addr, void *phys_addr, page_directory_t * pdir,
 		    mmc_t * mp);
 extern int page_unmap(void *virt_addr, page_directory_t * pdir);
 
+// frames beyond the direct map by frame number, high memory zones first,
+// then frames above 4GB with PAE. 0 if none is left. Access them with
+// kmap_atomic_pfn() or map them with page_map_pfn()
+extern _u32 get_free_pfn_high();
+extern int free_pfn_high(_u32 pfn);
+extern int page_map_pfn(void *virt_addr, _u32 pfn, page_directory_t * pdir);
+
+// map/unmap npg consecutive pages, TLB is flushed once for the whole range
+extern int page_map_range(void *virt_addr, void *phys_addr, size_t npg,
+			  page_directory_t * pdir, mmc_t * mp);
+extern int page_unmap_range(void *virt_addr, size_t npg,
+			    page_directory_t * pdir);
+// also drops references of user frames and swap slots in the range
+extern int page_unmap_user(void *virt_addr, size_t npg,
+			   page_directory_t * pdir);
+
+// above this number of pages a full TLB flush is cheaper than invlpg
+#define TLB_FLUSH_MAX_PAGES 32
+extern void flush_tlb_range(void *virt_addr, size_t npg);
+extern void flush_tlb_all();
+
 #define __virt_to_phys(pdir, va) ({ 	\
-	_u32 __addr = (_u32)(pdir)->tables[PDE_INDEX(va)] & PAGE_MASK;      \
-	__addr = (_u32)((page_table_t *)__addr)->pages[PTE_INDEX(va)] & PAGE_MASK;\
+	_u32 __addr = (_u32)((pdir)->tables[PDE_INDEX(va)] & PAGE_MASK);    \
+	__addr = (_u32)(((page_table_t *)__addr)->pages[PTE_INDEX(va)] &    \
+			PAGE_MASK);					    \
 	__addr | ((va) & (~PAGE_MASK)); })
 
+// update an entry which processors may be using at the same time, the value
+// seen before is returned. PAE entries take cmpxchg8b
+static inline page_entry_t pte_cmpxchg(page_entry_t * ptep, page_entry_t old,
+				       page_entry_t new)
+{
+	page_entry_t prev;
+
+#if PAGING_MODE == PAGING_PAE
+	asm volatile ("lock; cmpxchg8b %1":"=A" (prev), "+m"(*ptep)
+		      :"b"((_u32) new), "c"((_u32) (new >> 32)), "0"(old)
+		      :"cc");
+#else
+	asm volatile ("lock; cmpxchgl %2, %1":"=a" (prev), "+m"(*ptep)
+		      :"r"(new), "0"(old):"cc");
+#endif
+	return prev;
+}
+
 // notice: phys_to_virt is not unique, for now, address (<high memory) is
 //         direct mapping
 #define __phys_to_virt_lm(pdir, pa)	(pa)
@@ -0,0 +1,105 @@
+#ifndef RAWLOCK_H
+#define RAWLOCK_H
+
+#include "common.h"
+
+// kept apart from locking.h so headers below task.h can embed a lock
+
+// ticket lock, next is the ticket handed to the next taker and owner the
+// one being served. Locked when they differ, zero is unlocked
+typedef union {
+	volatile _u32 rlock;
+	struct {
+		volatile _u16 owner;
+		volatile _u16 next;
+	} t;
+} rawlock_t;
+
+#define RLOCK_TICKET 0x10000	// one ticket in rlock
+
+#ifdef ARCH_X86_32
+
+static inline uint_t xchg(volatile addr_t * addr, uint_t newval)
+{
+	uint_t result;
+
+	// The + in "+m" denotes a read-modify-write operand.
+	asm volatile ("lock; xchgl %0, %1":
+		      "+m" (*addr), "=a"(result):"1"(newval):"cc");
+	return result;
+}
+
+// store newval if *addr still equals oldval, return the value seen
+static inline uint_t cmpxchg(volatile addr_t * addr, uint_t oldval,
+			     uint_t newval)
+{
+	uint_t result;
+
+	asm volatile ("lock; cmpxchgl %2, %1":"=a" (result), "+m"(*addr)
+		      :"r"(newval), "0"(oldval):"cc");
+	return result;
+}
+
+// add val to *addr, return the value before
+static inline uint_t xadd(volatile addr_t * addr, uint_t val)
+{
+	asm volatile ("lock; xaddl %0, %1":"+r" (val), "+m"(*addr)::"cc",
+		      "memory");
+	return val;
+}
+
+// 16-bit counters shared without a lock
+static inline void atomic_inc16(volatile _u16 * v)
+{
+	asm volatile ("lock; incw %0":"+m" (*v)::"cc", "memory");
+}
+
+// non-zero if the counter dropped to zero
+static inline uint_t atomic_dec_and_test16(volatile _u16 * v)
+{
+	_u8 zero;
+
+	asm volatile ("lock; decw %0; sete %1":"+m" (*v), "=qm"(zero)::"cc",
+		      "memory");
+	return zero;
+}
+
+#endif
+
+// mproc.h, holders may be waiting for a TLB shootdown with interrupts off
+extern void smp_flush_tlb_check();
+
+static inline void init_rlock(rawlock_t * lk)
+{
+	lk->rlock = 0;
+}
+
+// take a ticket and wait for it, waiters are served in FIFO order
+static inline void lock_rlock(rawlock_t * lk)
+{
+	_u16 ticket = xadd(&lk->rlock, RLOCK_TICKET) >> 16;
+
+	while (lk->t.owner != ticket) {
+		smp_flush_tlb_check();
+		cpu_relax();
+	}
+}
+
+// take the lock only if nobody holds or waits for it, 0 on success
+static inline uint_t acquire_rlock(rawlock_t * lk)
+{
+	_u32 old = lk->rlock;
+
+	if ((old & 0xFFFF) != old >> 16)
+		return 1;
+	return cmpxchg(&lk->rlock, old, old + RLOCK_TICKET) != old;
+}
+
+// only the holder writes owner, the next ticket is served
+static inline void release_rlock(rawlock_t * lk)
+{
+	asm volatile ("":::"memory");
+	lk->t.owner++;
+}
+
+#endif
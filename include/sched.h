@@ -40,6 +40,7 @@ typedef struct {
 } rthread_list_t;
 
 // add newly created task and thread to cpu run queue
+void init_rq_cache();
 int init_task_sched(task_t * taskp);
 int init_thread_sched(thread_t * threadp);
 
@@ -0,0 +1,55 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "common.h"
+#include "list.h"
+#include "mm.h"
+#include "locking.h"
+
+/*
+ *  object caches, slabs are runs of frames from mm_phys cut into objects of
+ *  one size. Constructed objects keep their state across free/alloc
+ */
+
+#define SLAB_MAX_PAGES   8	// pages of one slab at most
+#define SLAB_OFF_LIMIT   (PAGE_SIZE / 8)	// larger objects keep headers off-slab
+
+// cache flags
+#define SLAB_HWCACHE_ALIGN 0x1	// align objects to L1_CACHE_BYTES
+
+typedef struct kmem_cache {
+	const char *name;
+	size_t size;		// object size with alignment
+	size_t align;
+	_u32 flags;
+	void (*ctor) (void *);
+
+	uint_t slab_pages;
+	uint_t objs_per_slab;
+	uint_t colour_max;	// colours, in align units
+	uint_t colour_next;
+	int off_slab;
+
+	list_head_t full;
+	list_head_t partial;
+	list_head_t empty;
+	uint_t nr_empty;
+	uint_t nr_objs;		// objects in use
+
+	rawlock_t lock;
+	list_head_t list;	// all caches
+} kmem_cache_t;
+
+extern void init_slab();
+extern kmem_cache_t *kmem_cache_create(const char *name, size_t size,
+				       size_t align, _u32 flags,
+				       void (*ctor) (void *));
+extern int kmem_cache_destroy(kmem_cache_t * cachep);
+extern void *kmem_cache_alloc(kmem_cache_t * cachep);
+extern void kmem_cache_free(kmem_cache_t * cachep, void *objp);
+
+// cache of a slab object, NULL if objp is not from any slab
+extern kmem_cache_t *kmem_cache_of(void *objp);
+extern void show_slabs();
+
+#endif
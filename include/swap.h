@@ -0,0 +1,48 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include "common.h"
+#include "mm.h"
+#include "paging.h"
+
+/*
+ *  page reclaim and swap space
+ */
+
+// swap area on a block device, one slot holds one page
+#define SWAP_DEV       "hda"	// build-macro
+#define SWAP_START_BLK 0x800	// build-macro: first block of swap area
+#define SWAP_PAGES     4096	// build-macro: slots of swap area
+#define BLKS_P_PAGE    (PAGE_SIZE / BLOCK_SIZE)
+
+// a swapped out page leaves a not-present entry holding its slot, the
+// protection bits of the page, NX included, are kept in the entry
+#define SWP_PROT_MASK        ((page_entry_t) 0xFFE | PAGE_NX)
+#define SWP_ENTRY(slot, pte) (((page_entry_t) (slot) << 12) | ((pte) \
+			      & SWP_PROT_MASK & ~PAGE_ACCESSED & ~PAGE_DIRTY) \
+			      | PAGE_SWAP)
+#define SWP_SLOT(pte)        ((_u32)(pte) >> 12)
+#define SWP_FLAGS(pte)       ((pte) & SWP_PROT_MASK & ~PAGE_SWAP)
+#define IS_SWAP_PTE(pte)     (!((_u32)(pte) & PAGE_PRESENT) \
+			      && ((_u32)(pte) & PAGE_SWAP))
+
+// free frames of mm_phys, kswapd wakes up below WMARK_LOW and reclaims
+// until WMARK_HIGH
+#define WMARK_MIN    32		// allocations shrink caches below this
+#define WMARK_LOW    128
+#define WMARK_HIGH   256
+#define SWAP_CLUSTER 32		// pages reclaimed directly by an allocation
+
+extern void init_swap();
+extern int swap_read_page(_u32 slot, void *page);
+extern void swap_dup(_u32 slot);
+extern void swap_free(_u32 slot);
+
+// LRU lists of anonymous pages
+extern void lru_add_page(page_t * page);
+extern void lru_del_page(page_t * page);
+
+extern uint_t try_to_free_pages(uint_t nr);
+extern int kswapd(void *args);
+
+#endif
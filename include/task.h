@@ -6,6 +6,8 @@
 #include "list.h"
 #include "paging.h"
 #include "timer.h"
+#include "vma.h"
+#include "arena.h"
 
 // stack size for each thread
 #define T_STACK_SIZE 0x1000
@@ -42,8 +44,9 @@ typedef struct {
 typedef struct task {
 	task_id_t task_id;
 	task_state_t status;
-	mmc_t *mm;
+	mmc_t *mm;		// kernel tasks only
 	page_directory_t *addr_space;
+	vm_space_t vm;		// user areas
 	struct task *parent;
 	list_head_t thread_list;
 	list_head_t task_list;
@@ -58,6 +61,7 @@ typedef struct thread {
 	addr_t kstack_base;
 	size_t kstack_size;
 	alarm_t alarm;
+	arena_t *arena;		// scratch objects, NULL until first used
 	task_t *task;
 	list_head_t thread_list;
 } __attribute__ ((packed)) thread_t;
@@ -73,6 +77,8 @@ extern int K_INIT(void *args);
 extern void setup_init_task();
 
 extern task_id_t create_task(int (*fn) (void *), void *arg);
+extern void for_each_addr_space(void (*fn) (page_directory_t *, void *),
+				void *arg);
 extern task_id_t create_kernel_task(int (*fn) (void *), void *arg);
 extern thread_id_t create_thread(int (*fn) (void *), void *arg);
 
@@ -18,6 +18,7 @@
 #define TICK_MSEC (CLOCK_INT_HZ / 1000 == 0 ? 1 : CLOCK_INT_HZ / 1000);
 
 extern void init_pit_timer(_u32 frequency);
+extern uint_t get_ticks();
 // end of PIT def ///////////////
 
 //////////////////////////////
@@ -10,6 +10,8 @@ typedef unsigned short _u16;
 typedef short _s16;
 typedef unsigned char _u8;
 typedef signed char _s8;
+typedef unsigned long long _u64;
+typedef long long _s64;
 
 typedef _u32 size_t;
 typedef _u32 uint_t;
@@ -0,0 +1,47 @@
+#ifndef VMA_H
+#define VMA_H
+
+#include "common.h"
+#include "avltree.h"
+
+/*
+ *  virtual memory areas of user tasks, ranges reserved by vm_map are
+ *  populated page by page on faults
+ */
+
+// protection of an area
+#define VM_READ  0x1
+#define VM_WRITE 0x2
+#define VM_EXEC  0x4
+
+typedef struct vma {
+	_u32 start;		// page aligned
+	_u32 end;		// exclusive
+	_u32 flags;
+	avl_node_t node;	// ordered by start, areas never overlap
+} vma_t;
+
+// areas of all tasks are guarded by one lock in vma.c, locking.h pulls in
+// task.h and cannot be included here
+typedef struct vm_space {
+	avl_node_t *root;
+	vma_t *cache;		// last area found
+} vm_space_t;
+
+extern void vm_space_init(vm_space_t * vm);
+extern int vm_space_copy(vm_space_t * src, vm_space_t * dst);
+extern void vm_space_free(vm_space_t * vm);
+
+// copy of the area containing addr, non-zero if there is none
+extern int lookup_vma(vm_space_t * vm, _u32 addr, vma_t * vma);
+
+// reserve/release ranges of current task, addr NULL lets vm_map pick one
+extern void *vm_map(void *addr, size_t len, _u32 flags);
+extern int vm_unmap(void *addr, size_t len);
+
+// user frames are unmapped under the lock of the areas, compaction takes it
+// while migrating pages. vma_trylock returns 1 if the lock was taken
+extern uint_t vma_trylock();
+extern void vma_unlock();
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include "common.h"
+#include "paging.h"
+#include "kmap.h"
+
+/*
+ *  virtually contiguous kernel memory backed by frames allocated one by one,
+ *  areas are placed in the window right after the kmap page table
+ */
+
+#define VMALLOC_START (KMAP_BASE + PGDIR_SIZE)
+#define VMALLOC_END   0xF0000000
+
+// vmalloc flags
+#define VM_GUARD 0x1		// leave one unmapped page after the area
+
+extern void *vmalloc(size_t size);
+extern void *__vmalloc(size_t size, _u32 flags);
+extern void vfree(void *addr);
+extern int is_vmalloc_addr(_u32 addr);
+
+#endif
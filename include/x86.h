@@ -7,6 +7,79 @@
 extern uint_t local_get_flags();
 extern void local_set_flags(uint_t flags);
 
+// CPUID feature flags in EDX of leaf 1
+#define CPUID_FEAT_EDX_PGE  (1 << 13)
+#define CPUID_FEAT_EDX_SSE2 (1 << 26)
+#define CPUID_FEAT_EDX_PAE  (1 << 6)
+
+// CPUID feature flags in EDX of leaf 0x80000001
+#define CPUID_EXT_LEAF      0x80000001
+#define CPUID_EXT_EDX_NX    (1 << 20)
+
+// data written by different CPUs should not share a line
+#define L1_CACHE_BYTES   64	// build-macro: colour step and default alignment
+#define __cacheline_aligned __attribute__ ((aligned(L1_CACHE_BYTES)))
+
+// EFLAGS bits
+#define EFLAGS_IF 0x200		// interrupts enabled
+
+// model specific registers
+#define MSR_EFER  0xC0000080
+#define EFER_NXE  0x800
+
+// spin-wait hint, saves power and the pipeline flush on loop exit
+static inline void cpu_relax()
+{
+	asm volatile ("pause":::"memory");
+}
+
+static inline void cpuid(_u32 op, _u32 * eax, _u32 * ebx, _u32 * ecx,
+			 _u32 * edx)
+{
+	asm volatile ("cpuid":"=a" (*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+		      :"a"(op), "c"(0));
+}
+
+static inline int cpu_has_feature_edx(_u32 feature)
+{
+	_u32 eax, ebx, ecx, edx;
+
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	return (edx & feature) != 0;
+}
+
+static inline int cpu_has_feature_ext_edx(_u32 feature)
+{
+	_u32 eax, ebx, ecx, edx;
+
+	cpuid(CPUID_EXT_LEAF & 0xF0000000, &eax, &ebx, &ecx, &edx);
+	if (eax < CPUID_EXT_LEAF)
+		return 0;
+	cpuid(CPUID_EXT_LEAF, &eax, &ebx, &ecx, &edx);
+	return (edx & feature) != 0;
+}
+
+static inline _u64 rdtsc()
+{
+	_u64 val;
+
+	asm volatile ("rdtsc":"=A" (val));
+	return val;
+}
+
+static inline _u64 rdmsr(_u32 msr)
+{
+	_u64 val;
+
+	asm volatile ("rdmsr":"=A" (val):"c"(msr));
+	return val;
+}
+
+static inline void wrmsr(_u32 msr, _u64 val)
+{
+	asm volatile ("wrmsr"::"c" (msr), "A"(val));
+}
+
 // write sequential memory bytes to the specified port
 static inline void outsl(int port, const void *addr, int cnt)
 {
@@ -0,0 +1,126 @@
+/*
+ *      Red Magic 1996 - 2015
+ *
+ *      arena.c - bump allocation for short-lived objects
+ *
+ *      2015 Lin Coin - initial version
+ */
+
+#include "common.h"
+#include "arena.h"
+#include "mm.h"
+#include "sched.h"
+#include "klog.h"
+
+typedef struct {
+	list_head_t list;
+	size_t pages;
+} arena_chunk_t;
+
+#define CHUNK_HDR ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) \
+		   & ~(ARENA_ALIGN - 1))
+#define ARENA_HDR ((sizeof(arena_t) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+// first byte for objects in the first chunk
+#define ARENA_BASE(arena) ((addr_t) (arena) + ARENA_HDR)
+
+static arena_chunk_t *alloc_chunk(size_t pages)
+{
+	arena_chunk_t *chunk = get_free_pages(pages);
+
+	if (chunk == NULL)
+		return NULL;
+	chunk->pages = pages;
+	return chunk;
+}
+
+arena_t *arena_create(size_t chunk_pages)
+{
+	arena_chunk_t *chunk;
+	arena_t *arena;
+
+	if (chunk_pages == 0)
+		chunk_pages = ARENA_CHUNK_PAGES;
+	chunk = alloc_chunk(chunk_pages);
+	if (chunk == NULL)
+		return NULL;
+
+	arena = (arena_t *) ((addr_t) chunk + CHUNK_HDR);
+	INIT_LIST_HEAD(&arena->chunks);
+	list_add(&chunk->list, &arena->chunks);
+	arena->cur = ARENA_BASE(arena);
+	arena->end = (addr_t) chunk + chunk_pages * PAGE_SIZE;
+	arena->chunk_pages = chunk_pages;
+
+	return arena;
+}
+
+void *arena_alloc(arena_t * arena, size_t size)
+{
+	arena_chunk_t *chunk;
+	size_t pages;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	// the rest of the last chunk is left unused
+	if (arena->end - arena->cur < size) {
+		pages = PAGE_CONTAIN(size + CHUNK_HDR);
+		if (pages < arena->chunk_pages)
+			pages = arena->chunk_pages;
+		chunk = alloc_chunk(pages);
+		if (chunk == NULL) {
+			log_err(LOG_MM "arena 0x%08X: no %d pages\n", arena,
+				pages);
+			return NULL;
+		}
+		list_add_tail(&chunk->list, &arena->chunks);
+		arena->cur = (addr_t) chunk + CHUNK_HDR;
+		arena->end = (addr_t) chunk + pages * PAGE_SIZE;
+	}
+
+	p = (void *)arena->cur;
+	arena->cur += size;
+	return p;
+}
+
+// free all chunks after the first one, which holds the arena itself
+static void free_chunks(arena_t * arena)
+{
+	arena_chunk_t *chunk, *tmp, *first;
+
+	first = list_first_entry(&arena->chunks, arena_chunk_t, list);
+	list_for_each_entry_safe(chunk, tmp, &arena->chunks, list) {
+		if (chunk == first)
+			continue;
+		list_del(&chunk->list);
+		free_pages(chunk);
+	}
+}
+
+void arena_reset(arena_t * arena)
+{
+	arena_chunk_t *first;
+
+	free_chunks(arena);
+	first = list_first_entry(&arena->chunks, arena_chunk_t, list);
+	arena->cur = ARENA_BASE(arena);
+	arena->end = (addr_t) first + first->pages * PAGE_SIZE;
+}
+
+void arena_destroy(arena_t * arena)
+{
+	if (arena == NULL)
+		return;
+	free_chunks(arena);
+	free_pages(list_first_entry(&arena->chunks, arena_chunk_t, list));
+}
+
+arena_t *thread_arena()
+{
+	thread_t *thr = get_curr_thread();
+
+	if (thr->arena == NULL)
+		thr->arena = arena_create(ARENA_CHUNK_PAGES);
+	return thr->arena;
+}
@@ -0,0 +1,115 @@
+/*
+ *      Red Magic 1996 - 2015
+ *
+ *      avltree.c - intrusive AVL tree
+ *
+ *      2015 Lin Coin - initial version
+ */
+
+#include "common.h"
+#include "avltree.h"
+
+static inline int avl_height(avl_node_t * node)
+{
+	return node ? node->height : 0;
+}
+
+static inline void avl_update(avl_node_t * node)
+{
+	int hl = avl_height(node->left), hr = avl_height(node->right);
+
+	node->height = (hl > hr ? hl : hr) + 1;
+}
+
+static avl_node_t *avl_rotate_right(avl_node_t * node)
+{
+	avl_node_t *l = node->left;
+
+	node->left = l->right;
+	l->right = node;
+	avl_update(node);
+	avl_update(l);
+	return l;
+}
+
+static avl_node_t *avl_rotate_left(avl_node_t * node)
+{
+	avl_node_t *r = node->right;
+
+	node->right = r->left;
+	r->left = node;
+	avl_update(node);
+	avl_update(r);
+	return r;
+}
+
+// subtrees of node differ in height by at most 2 after one insert/remove
+static avl_node_t *avl_balance(avl_node_t * node)
+{
+	int bf;
+
+	avl_update(node);
+	bf = avl_height(node->left) - avl_height(node->right);
+	if (bf > 1) {
+		if (avl_height(node->left->left) <
+		    avl_height(node->left->right))
+			node->left = avl_rotate_left(node->left);
+		return avl_rotate_right(node);
+	}
+	if (bf < -1) {
+		if (avl_height(node->right->right) <
+		    avl_height(node->right->left))
+			node->right = avl_rotate_right(node->right);
+		return avl_rotate_left(node);
+	}
+	return node;
+}
+
+avl_node_t *avl_insert(avl_node_t * root, avl_node_t * node, avl_cmp_t cmp)
+{
+	if (root == NULL) {
+		node->left = node->right = NULL;
+		node->height = 1;
+		return node;
+	}
+
+	if (cmp(node, root) < 0)
+		root->left = avl_insert(root->left, node, cmp);
+	else
+		root->right = avl_insert(root->right, node, cmp);
+	return avl_balance(root);
+}
+
+static avl_node_t *avl_remove_min(avl_node_t * root, avl_node_t ** min)
+{
+	if (root->left == NULL) {
+		*min = root;
+		return root->right;
+	}
+	root->left = avl_remove_min(root->left, min);
+	return avl_balance(root);
+}
+
+avl_node_t *avl_remove(avl_node_t * root, avl_node_t * node, avl_cmp_t cmp)
+{
+	avl_node_t *min, *right;
+
+	if (root == NULL)
+		return NULL;
+
+	if (root != node) {
+		if (cmp(node, root) < 0)
+			root->left = avl_remove(root->left, node, cmp);
+		else
+			root->right = avl_remove(root->right, node, cmp);
+		return avl_balance(root);
+	}
+
+	// replace node with the smallest one of its right subtree
+	if (root->right == NULL)
+		return root->left;
+	right = avl_remove_min(root->right, &min);
+	min->left = root->left;
+	min->right = right;
+	return avl_balance(min);
+}
@@ -12,6 +12,8 @@
 #include "string.h"
 #include "sched.h"
 #include "klog.h"
+#include "swap.h"
+#include "slab.h"
 
 #define MAX_BGET_RETRY 1
 
@@ -32,30 +34,97 @@ static int update_buffer(buf_cache_t * buf);
 static void queue_buffer(blk_dev_t * bdev, buf_cache_t * buf);
 static void dequeue_buffer(blk_dev_t * bdev, buf_cache_t * buf);
 
+static buf_cache_t *alloc_buffer(blk_dev_t * bdev);
+static kmem_cache_t *buf_cachep;
+static uint_t bbuf_count(shrinker_t * shrinker);
+static uint_t bbuf_scan(shrinker_t * shrinker, uint_t nr);
+
+// blks buffers are always kept, more are added while memory is plenty and
+// dropped by the shrinker when it is not
 int bdev_init_buffer_cache(blk_dev_t * bdev, size_t blks)
 {
 	buf_cache_t *buf;
 
+	// shared by buffers of all devices
+	if (buf_cachep == NULL) {
+		buf_cachep = kmem_cache_create("buf_cache", sizeof(buf_cache_t),
+					       0, SLAB_HWCACHE_ALIGN, NULL);
+		if (buf_cachep == NULL)
+			return -1;
+	}
+
 	bdev->buf_num = blks;
+	bdev->buf_min = blks;
 	for (; blks > 0; blks--) {
-		buf = (buf_cache_t *) kmalloc(sizeof(buf_cache_t));
+		buf = alloc_buffer(bdev);
 		if (buf == NULL)
 			return -1;
+		list_add_tail(&buf->list, &bdev->list);
+	}
 
-		buf->bdev = bdev;
-		buf->blkno = 0;
-		buf->flags = B_UNUSED;
-		buf->usr = NULL;
+	bdev->shrinker.count = bbuf_count;
+	bdev->shrinker.scan = bbuf_scan;
+	if (register_shrinker(&bdev->shrinker) != OK)
+		log_warn(LOG_BLOCK "no shrinker for dev 0x%08X\n", bdev);
 
-		// link the buffer and zero IO & waiting list
-		list_add_tail(&buf->list, &bdev->list);
-		INIT_LIST_HEAD(&buf->io);
-		INIT_LIST_HEAD(&buf->wq);
+	return OK;
+}
+
+static buf_cache_t *alloc_buffer(blk_dev_t * bdev)
+{
+	buf_cache_t *buf;
+
+	buf = (buf_cache_t *) kmem_cache_alloc(buf_cachep);
+	if (buf == NULL)
+		return NULL;
+
+	buf->bdev = bdev;
+	buf->blkno = 0;
+	buf->flags = B_UNUSED;
+	buf->usr = NULL;
+
+	// zero IO & waiting list
+	INIT_LIST_HEAD(&buf->list);
+	INIT_LIST_HEAD(&buf->io);
+	INIT_LIST_HEAD(&buf->wq);
 
-		bzero(buf->data, BLOCK_SIZE);
+	bzero(buf->data, BLOCK_SIZE);
+	return buf;
+}
+
+// buffers over buf_min which are neither in use nor dirty
+static uint_t bbuf_count(shrinker_t * shrinker)
+{
+	blk_dev_t *bdev = container_of(shrinker, blk_dev_t, shrinker);
+
+	return bdev->buf_num > bdev->buf_min ? bdev->buf_num - bdev->buf_min :
+	    0;
+}
+
+// least recently used buffers are at the tail. Reclaim may not sleep, a
+// device busy with IO is skipped
+static uint_t bbuf_scan(shrinker_t * shrinker, uint_t nr)
+{
+	blk_dev_t *bdev = container_of(shrinker, blk_dev_t, shrinker);
+	buf_cache_t *buf, *tmp;
+	uint_t freed = 0;
+
+	if (!mutex_trylock(&bdev->lock))
+		return 0;
+	list_for_each_entry_safe_reverse(buf, tmp, &bdev->list, list) {
+		if (freed >= nr || bdev->buf_num <= bdev->buf_min)
+			break;
+		if ((buf->flags & (B_BUSY | B_DIRTY)) || buf->usr != NULL
+		    || !list_empty(&buf->wq))
+			continue;
+		list_del(&buf->list);
+		bdev->buf_num--;
+		kmem_cache_free(buf_cachep, buf);
+		freed++;
 	}
+	mutex_unlock(&bdev->lock);
 
-	return OK;
+	return freed;
 }
 
 int bdev_read_buffer(blk_dev_t * bdev, uint_t blkno, char *data)
@@ -222,7 +291,21 @@ static buf_cache_t *get_buffer(blk_dev_t * bdev, uint_t blkno)
 
 	mutex_unlock(&bdev->lock);
 
-	// no available buffers, flush dirty buffers and try again
+	// no available buffers, grow the cache if memory is plenty. The new
+	// buffer is picked up by the scan from tail, blkno may have been
+	// cached by others meanwhile
+	if (mm_phys.nfree >= WMARK_HIGH) {
+		buf = alloc_buffer(bdev);
+		if (buf != NULL) {
+			mutex_lock(&bdev->lock);
+			list_add_tail(&buf->list, &bdev->list);
+			bdev->buf_num++;
+			mutex_unlock(&bdev->lock);
+			goto retry;
+		}
+	}
+
+	// flush dirty buffers and try again
 	if (retry++ < MAX_BGET_RETRY) {
 		sync_buffer(bdev);
 		goto retry;
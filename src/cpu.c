@@ -11,18 +11,23 @@
 #include "list.h"
 #include "string.h"
 #include "klog.h"
+#include "memblock.h"
 
 // defined in mproc.c
 extern int init_mp();
+extern int mp_count_cpus();
 
-cpu_state_t cpuset[MAX_CPUS];
+cpu_state_t *cpuset;
 
 void init_bootstrap_processor()
 {
 	int ap;
 
 	printk("intialize processors ...\n");
-	bzero(cpuset, sizeof(cpuset));
+	cpuset = memblock_alloc(mp_count_cpus() * sizeof(cpu_state_t),
+				L1_CACHE_BYTES);
+	if (cpuset == NULL)
+		PANIC(LOG_CPU "no memory for cpuset");
 	ap = init_mp();
 	if (ap < 0) {
 		PANIC(LOG_CPU "init_mp: error");
@@ -53,6 +53,12 @@ void print_stack_trace()
 	}
 }
 
+// function containing addr, NULL if symbols were not loaded
+const char *lookup_kernel_symbol(addr_t addr)
+{
+	return elf_lookup_symbol(addr, &kernel_elf);
+}
+
 void print_memory(void *bp, _u32 lines)
 {
 	_u32 *p = (_u32 *) bp;
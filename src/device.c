@@ -73,7 +73,8 @@ static void __init_blk_dev_common(dev_t * dev)
 	blk_dev_t *blk_dev;
 
 	// TODO destroy device 'kfree'
-	dev->ptr = (blk_dev_t *) kmalloc(sizeof(blk_dev_t));
+	dev->ptr = (blk_dev_t *) kmalloc_aligned(sizeof(blk_dev_t),
+						 L1_CACHE_BYTES);
 	if (dev->ptr == NULL)
 		PANIC("common blk_dev_init failed");
 	blk_dev = dev->ptr;
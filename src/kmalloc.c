@@ -19,27 +19,54 @@
 #include "debug.h"
 #include "string.h"
 #include "klog.h"
+#include "x86.h"
+#include "cpu.h"
+#include "timer.h"
 
 static void *__kmalloc(size_t size, heap_desc_t * heap);
+static void *__kmalloc_aligned(size_t size, size_t align,
+			       heap_desc_t * heap);
 static int __kfree(void *p, heap_desc_t * heap);
 static int INIT_HEAP(heap_desc_t * heap);
 static void show_heap(heap_desc_t * heap);
+#if HEAP_TYPE == HEAP_TYPE_FB
+static int flush_bins(heap_desc_t * heap);
+static void merge_free_block(heap_desc_t * heap, heap_block_t * found);
+static void *depot_alloc(size_t size, size_t align, heap_desc_t * heap);
+static void *mag_alloc(size_t size, heap_desc_t * heap);
+static int mag_free(void *p, heap_desc_t * heap);
+#endif
 
 // global kernel heap descriptor
 static heap_desc_t kheap;
 
+#if HEAP_PROFILE
+static void prof_alloc(void *p, size_t size, addr_t site);
+static void prof_free(void *p);
+#define PROF_ALLOC(p, size) \
+	prof_alloc(p, size, (addr_t) __builtin_return_address(0))
+#define PROF_FREE(p) prof_free(p)
+#else
+#define PROF_ALLOC(p, size)
+#define PROF_FREE(p)
+#endif
+
 int init_heap(heap_desc_t * heap, mmc_t * mp, const char *name, size_t size)
 {
 	size_t pages = PAGE_CONTAIN(size);
-	void *start = alloc_frames(mp, pages);
+	void *start;
 
+	// slabs are allocated as they are needed, no arena is reserved
+	if (HEAP_TYPE == HEAP_TYPE_SLAB)
+		pages = 0;
+	start = pages ? alloc_frames(mp, pages) : mp->base;
 	if (start == NULL)
 		return 1;
 
 	heap->mmcp = mp;
 	heap->heap_name = name;
 	heap->start = (addr_t) start;
-	heap->end = heap->start + size;
+	heap->end = heap->start + pages * PAGE_SIZE;
 
 	return INIT_HEAP(heap);
 }
@@ -48,55 +75,357 @@ void init_kheap()
 {
 	if (init_heap(&kheap, &mm_phys, "kernel_heap", K_HEAP_SIZE))
 		PANIC("Kernel heap not set up");
+#if HEAP_TYPE == HEAP_TYPE_FB
+	kheap.grow_pages = PAGE_CONTAIN(K_HEAP_GROW);
+#endif
 }
 
-void *kmalloc(size_t size)
+static inline void *kheap_alloc(size_t size)
 {
 	// make sure kernel heap has been initialized
-	ASSERT(kheap.start && kheap.end);
+	ASSERT(kheap.heap_name != NULL);
+#if HEAP_TYPE == HEAP_TYPE_FB
+	return mag_alloc(size, &kheap);
+#else
 	return __kmalloc(size, &kheap);
+#endif
+}
+
+void *kmalloc(size_t size)
+{
+	void *p = kheap_alloc(size);
+
+	PROF_ALLOC(p, size);
+	return p;
+}
+
+// align is a power of two, at most PAGE_SIZE
+void *kmalloc_aligned(size_t size, size_t align)
+{
+	void *p;
+
+	ASSERT(kheap.heap_name != NULL);
+	if (align & (align - 1) || align > PAGE_SIZE)
+		return NULL;
+#if HEAP_TYPE == HEAP_TYPE_FB
+	p = depot_alloc(size, align, &kheap);
+#else
+	p = __kmalloc_aligned(size, align, &kheap);
+#endif
+	PROF_ALLOC(p, size);
+	return p;
+}
+
+void *kzalloc(size_t size)
+{
+	void *p = kheap_alloc(size);
+
+	if (p != NULL)
+		memset(p, 0, size);
+	PROF_ALLOC(p, size);
+	return p;
 }
 
 int kfree(void *p)
 {
-	ASSERT(kheap.start && kheap.end);
+	ASSERT(kheap.heap_name != NULL);
+	PROF_FREE(p);
+#if HEAP_TYPE == HEAP_TYPE_FB
+	return mag_free(p, &kheap);
+#else
 	return __kfree(p, &kheap);
+#endif
 }
 
-#if INIT_HEAP == HEAP_FB
+#if HEAP_PROFILE
+
+// call sites are hashed by return address and live objects by pointer,
+// both with linear probing. Objects are removed by shifting the rest of
+// their run back, so there are no tombstones
+#define PROF_SITES 128
+#define PROF_OBJS  2048
+#define PROF_HASH(x, n) ((((x) >> 4) ^ ((x) >> 14)) & ((n) - 1))
+
+typedef struct {
+	addr_t site;
+	size_t bytes;		// live
+	size_t peak;
+	uint_t live;
+	uint_t allocs;
+} prof_site_t;
+
+typedef struct {
+	void *p;
+	size_t size;
+	uint_t born;		// ticks
+	uint_t site;		// index of prof_sites
+} prof_obj_t;
+
+static prof_site_t prof_sites[PROF_SITES];
+static prof_obj_t prof_objs[PROF_OBJS];
+static uint_t prof_nsites, prof_nobjs;
+static uint_t prof_lost;	// allocations not tagged, tables were full
+static rawlock_t prof_lock;
+
+static inline uint_t prof_lock_irqsave()
+{
+	uint_t flags = local_get_flags();
 
-// first-best allocation
-static int HEAP_FB(heap_desc_t * heap)
+	local_irq_disable();
+	lock_rlock(&prof_lock);
+	return flags;
+}
+
+static inline void prof_unlock_irqrestore(uint_t flags)
+{
+	release_rlock(&prof_lock);
+	local_set_flags(flags);
+}
+
+static void prof_alloc(void *p, size_t size, addr_t site)
+{
+	prof_site_t *sp;
+	uint_t flags, s, n;
+
+	if (p == NULL)
+		return;
+
+	flags = prof_lock_irqsave();
+	s = PROF_HASH(site, PROF_SITES);
+	while (prof_sites[s].site != site && prof_sites[s].site != 0)
+		s = (s + 1) & (PROF_SITES - 1);
+	// keep a slot free so that probing always ends
+	if ((prof_sites[s].site == 0 && prof_nsites == PROF_SITES - 1)
+	    || prof_nobjs == PROF_OBJS - 1) {
+		prof_lost++;
+		prof_unlock_irqrestore(flags);
+		return;
+	}
+
+	sp = &prof_sites[s];
+	if (sp->site == 0) {
+		sp->site = site;
+		prof_nsites++;
+	}
+	sp->bytes += size;
+	sp->live++;
+	sp->allocs++;
+	if (sp->bytes > sp->peak)
+		sp->peak = sp->bytes;
+
+	n = PROF_HASH((addr_t) p, PROF_OBJS);
+	while (prof_objs[n].p != NULL)
+		n = (n + 1) & (PROF_OBJS - 1);
+	prof_objs[n].p = p;
+	prof_objs[n].size = size;
+	prof_objs[n].born = get_ticks();
+	prof_objs[n].site = s;
+	prof_nobjs++;
+	prof_unlock_irqrestore(flags);
+}
+
+static void prof_free(void *p)
+{
+	prof_site_t *sp;
+	uint_t flags, n, next, home;
+
+	flags = prof_lock_irqsave();
+	n = PROF_HASH((addr_t) p, PROF_OBJS);
+	while (prof_objs[n].p != p && prof_objs[n].p != NULL)
+		n = (n + 1) & (PROF_OBJS - 1);
+	if (prof_objs[n].p == NULL) {
+		prof_unlock_irqrestore(flags);
+		return;
+	}
+
+	sp = &prof_sites[prof_objs[n].site];
+	sp->bytes -= prof_objs[n].size;
+	sp->live--;
+	prof_nobjs--;
+
+	// move entries of the run whose home is not between the hole and them
+	for (next = (n + 1) & (PROF_OBJS - 1); prof_objs[next].p != NULL;
+	     next = (next + 1) & (PROF_OBJS - 1)) {
+		home = PROF_HASH((addr_t) prof_objs[next].p, PROF_OBJS);
+		if (((next - home) & (PROF_OBJS - 1)) <
+		    ((next - n) & (PROF_OBJS - 1)))
+			continue;
+		prof_objs[n] = prof_objs[next];
+		n = next;
+	}
+	prof_objs[n].p = NULL;
+	prof_unlock_irqrestore(flags);
+}
+
+static void print_site(addr_t site)
+{
+	const char *name = lookup_kernel_symbol(site);
+
+	printk("[0x%08X] %s", site, name ? name : "?");
+}
+
+void show_kmalloc_sites(uint_t top, uint_t age)
+{
+	prof_site_t *sp;
+	uint_t flags, now, n, i, last = ~0, best;
+	size_t bytes, limit = ~0;
+
+	flags = prof_lock_irqsave();
+	printk("kmalloc sites: %d, objects: %d, untagged: %d\n", prof_nsites,
+	       prof_nobjs, prof_lost);
+
+	// selection by live bytes, the table is small
+	for (i = 0; i < top; i++) {
+		best = PROF_SITES;
+		bytes = 0;
+		for (n = 0; n < PROF_SITES; n++) {
+			sp = &prof_sites[n];
+			if (sp->site == 0 || sp->bytes > limit
+			    || (sp->bytes == limit && n <= last))
+				continue;
+			if (best == PROF_SITES || sp->bytes > bytes) {
+				best = n;
+				bytes = sp->bytes;
+			}
+		}
+		if (best == PROF_SITES)
+			break;
+		sp = &prof_sites[best];
+		printk(" %d bytes in %d, peak %d, allocs %d ", sp->bytes,
+		       sp->live, sp->peak, sp->allocs);
+		print_site(sp->site);
+		printk("\n");
+		limit = sp->bytes;
+		last = best;
+	}
+
+	printk("alive for more than %d seconds:\n", age);
+	now = get_ticks();
+	for (n = 0, i = 0; n < PROF_OBJS && i < top; n++) {
+		if (prof_objs[n].p == NULL
+		    || now - prof_objs[n].born <= age * TICK_SEC)
+			continue;
+		printk(" 0x%08X %d bytes, %d s ", prof_objs[n].p,
+		       prof_objs[n].size,
+		       (now - prof_objs[n].born) / TICK_SEC);
+		print_site(prof_sites[prof_objs[n].site].site);
+		printk("\n");
+		i++;
+	}
+	prof_unlock_irqrestore(flags);
+}
+
+#endif
+
+#if HEAP_TYPE == HEAP_TYPE_FB
+
+#define HBLK_FOOTER(hbp) \
+	((size_t *)((addr_t) (hbp) + HBLK_SIZE(hbp) - sizeof(size_t)))
+#define HBLK_SIZE(hbp)   ((hbp)->size & ~HBLK_USED)
+#define HBLK_NEXT(hbp)   ((heap_block_t *)((addr_t) (hbp) + HBLK_SIZE(hbp)))
+#define HBLK_PAYLOAD(hbp) ((void *)((addr_t) (hbp) + HBLK_HDR))
+#define HBLK_HEADER(p)   ((heap_block_t *)((addr_t) (p) - HBLK_HDR))
+
+static inline void set_block(heap_block_t * hbp, size_t size, int used)
+{
+	hbp->size = size | (used ? HBLK_USED : 0);
+	hbp->magic = HBLK_MAGIC;
+	*HBLK_FOOTER(hbp) = hbp->size;
+}
+
+// mark a free block taken off the lists as used, its tail goes back to the
+// free list if it can hold a block
+static void take_block(heap_desc_t * heap, heap_block_t * hbp, size_t need)
 {
-	heap_block_t *p, *metap;
+	heap_block_t *rest;
+	size_t delta = hbp->size - need;
+
+	if (delta >= HBLK_MIN) {
+		set_block(hbp, need, 1);
+		rest = HBLK_NEXT(hbp);
+		set_block(rest, delta, 0);
+		list_add(&rest->lh, &heap->free);
+	} else
+		set_block(hbp, hbp->size, 1);
+}
+
+#define ARENA_FENCE(ap) \
+	((size_t *)((addr_t) (ap) + ARENA_HDR - sizeof(size_t)))
+#define ARENA_END(ap) ((addr_t) (ap) + (ap)->pages * PAGE_SIZE - HBLK_ALIGN)
 
-	// get a free page and initialize free list and reserved list
-	metap = (heap_block_t *) alloc_frame(heap->mmcp);
+// one free block between the fence and the sentinel
+static void add_arena(heap_desc_t * heap, heap_arena_t * ap, size_t pages)
+{
+	heap_block_t *p, *end;
+
+	ap->pages = pages;
+	list_add_tail(&ap->list, &heap->arenas);
+	*ARENA_FENCE(ap) = HBLK_USED;
+
+	p = (heap_block_t *) ((addr_t) ap + ARENA_HDR);
+	end = (heap_block_t *) ARENA_END(ap);
+	set_block(p, (addr_t) end - (addr_t) p, 0);
+	list_add(&p->lh, &heap->free);
+	end->size = HBLK_USED;
+	end->magic = HBLK_MAGIC;
+}
 
-	if (!metap)
+// add an arena that holds a block of need bytes, 0 on success
+static int grow_heap(heap_desc_t * heap, size_t need)
+{
+	size_t pages = PAGE_CONTAIN(need + ARENA_HDR + HBLK_ALIGN);
+	heap_arena_t *ap;
+
+	if (heap->grow_pages == 0)
+		return 1;
+	if (pages < heap->grow_pages)
+		pages = heap->grow_pages;
+	ap = alloc_frames(heap->mmcp, pages);
+	if (ap == NULL)
 		return 1;
 
-	p = metap;
-	heap->free = p++;
-	heap->res = p++;
-	heap->avail = p++;
+	add_arena(heap, ap, pages);
+	log_dbg("heap %s grows by %d pages at 0x%08X\n", heap->heap_name,
+		pages, ap);
+	return 0;
+}
+
+// header of a block handed out by the heap, NULL for anything else
+static heap_block_t *used_block(heap_desc_t * heap, void *p)
+{
+	heap_block_t *hbp = (heap_block_t *) ((addr_t) p - HBLK_HDR);
+	heap_arena_t *ap;
+
+	list_for_each_entry(ap, &heap->arenas, list) {
+		if ((addr_t) hbp < (addr_t) ap + ARENA_HDR
+		    || (addr_t) hbp >= ARENA_END(ap))
+			continue;
+		if (hbp->magic != HBLK_MAGIC || !(hbp->size & HBLK_USED))
+			return NULL;
+		return hbp;
+	}
+	return NULL;
+}
 
-	INIT_LIST_HEAD(&(heap->free->lh));
-	INIT_LIST_HEAD(&(heap->res->lh));
-	INIT_LIST_HEAD(&(heap->avail->lh));
+// first-best allocation
+static int HEAP_FB(heap_desc_t * heap)
+{
+	int i;
+
+	INIT_LIST_HEAD(&heap->free);
+	for (i = 0; i < HEAP_BINS; i++)
+		INIT_LIST_HEAD(&heap->bins[i]);
+	heap->use_bins = 1;
+	INIT_LIST_HEAD(&heap->arenas);
+	heap->grow_pages = 0;
+	init_rlock(&heap->lock);
 
 	log_info("init heap: %s ...\n start = 0x%08X, end = 0x%08X\n",
 		 heap->heap_name, heap->start, heap->end);
-	log_info(" head = 0x%08X\n", (addr_t) metap);
 
-	p->base = heap->start;
-	p->size = heap->end - heap->start;
-	list_add(&p->lh, &(heap->free->lh));
-	p++;
-
-	// initialize 'avail' list
-	for (; (addr_t) p < (addr_t) metap + PAGE_SIZE; p++)
-		list_add_tail(&p->lh, &(heap->avail->lh));
+	// the initial arena is kept for the life of the heap
+	add_arena(heap, (heap_arena_t *) heap->start,
+		  (heap->end - heap->start) / PAGE_SIZE);
 
 	return 0;
 }
@@ -104,110 +433,150 @@ static int HEAP_FB(heap_desc_t * heap)
 static void *__kmalloc(size_t size, heap_desc_t * heap)
 {
 	heap_block_t *hbp, *found = NULL;
-	heap_block_t *metap, *p;
-
-	heap_block_t *hd_free = heap->free;
-	heap_block_t *hd_res = heap->res;
-	heap_block_t *hd_avail = heap->avail;
-
-	size_t delta = ~0;
-
-	list_for_each_entry(hbp, &hd_free->lh, lh) {
+	size_t need, delta = ~0;
+	int flushed = 0, grown = 0;
+
+	// small sizes are served by their bin in O(1)
+	if (heap->use_bins && size <= HEAP_BIN_MAX) {
+		size = size ? (size + HEAP_BIN_SIZE - 1) & ~(HEAP_BIN_SIZE - 1)
+		    : HEAP_BIN_SIZE;
+		need = HEAP_BIN_BLOCK(size);
+		hbp = list_first_entry_or_null(&heap->bins[HEAP_BIN_INDEX(need)],
+					       heap_block_t, lh);
+		if (hbp != NULL) {
+			list_del(&hbp->lh);
+			hbp->magic = HBLK_MAGIC;
+			return HBLK_PAYLOAD(hbp);
+		}
+	} else
+		need = (size + HBLK_OVERHEAD + HBLK_ALIGN - 1) &
+		    ~(HBLK_ALIGN - 1);
+	if (need < HBLK_MIN)
+		need = HBLK_MIN;
+
+      retry:
+	list_for_each_entry(hbp, &heap->free, lh) {
 		// look for the best fit by delta
-		if (hbp->size > size) {
-			if (hbp->size - size < delta) {
-				delta = hbp->size - size;
+		if (hbp->size > need) {
+			if (hbp->size - need < delta) {
+				delta = hbp->size - need;
 				found = hbp;
 			}
-		} else if (hbp->size == size) {
+		} else if (hbp->size == need) {
 			// gotcha
-			list_move(&hbp->lh, &hd_res->lh);
-			return (void *)(hbp->base);
+			found = hbp;
+			delta = 0;
+			break;
 		}
 	}
 
+	if (!found && !flushed) {
+		flushed = 1;
+		if (flush_bins(heap))
+			goto retry;
+	}
+	if (!found && !grown) {
+		grown = 1;
+		if (grow_heap(heap, need) == 0)
+			goto retry;
+	}
 	if (!found) {
 		log_err("no more blocks of size %d bytes for heap %s\n", size,
 			heap->heap_name);
 		return NULL;
 	}
-	// add new entry for 'res' list
-	hbp = list_first_entry_or_null(&hd_avail->lh, heap_block_t, lh);
-	if (hbp == NULL) {
-		// well, we do not have space for new entries, allocate
-		// another page.
-		metap = (heap_block_t *) alloc_frame(heap->mmcp);
-		if (!metap)
-			return NULL;
-		bzero(metap, PAGE_SIZE);
 
-		// initialize 'avail' list
-		for (p = metap; (addr_t) p < (addr_t) metap + PAGE_SIZE; p++)
-			list_add_tail(&p->lh, &hd_avail->lh);
-
-		// retry now
-		hbp = list_first_entry_or_null(&hd_avail->lh, heap_block_t, lh);
-		if (hbp == NULL)
-			return NULL;
-	}
-	// init new entry and add this entry to 'res' list
-	hbp->size = size;
-	hbp->base = found->base;
-	found->size -= size;
-	found->base += size;
-	list_move(&hbp->lh, &hd_res->lh);
+	list_del(&found->lh);
+	take_block(heap, found, need);
 
 	if (KLOG_DBG) {
 		printk("\n<__kmalloc: 0x%08X> \n", size);
 		show_heap(heap);
 	}
 
-	return (void *)(hbp->base);
+	return HBLK_PAYLOAD(found);
 }
 
-static int __kfree(void *p, heap_desc_t * heap)
+// best fit for a payload on an align boundary. The space in front of the
+// payload is split off as a free block, so nothing is over-allocated
+static void *__kmalloc_aligned(size_t size, size_t align, heap_desc_t * heap)
 {
 	heap_block_t *hbp, *found = NULL;
-	heap_block_t *lp = NULL, *rp = NULL;
-
-	heap_block_t *hd_free = heap->free;
-	heap_block_t *hd_res = heap->res;
-	heap_block_t *hd_avail = heap->avail;
-
-	list_for_each_entry(hbp, &hd_res->lh, lh) {
-		if (hbp->base == (addr_t) p) {
+	addr_t start, best = 0;
+	size_t need, lead, delta = ~0;
+	int flushed = 0, grown = 0;
+
+	if (align <= HBLK_ALIGN)
+		return __kmalloc(size, heap);
+
+	need = (size + HBLK_OVERHEAD + HBLK_ALIGN - 1) & ~(HBLK_ALIGN - 1);
+	if (need < HBLK_MIN)
+		need = HBLK_MIN;
+
+      retry:
+	list_for_each_entry(hbp, &heap->free, lh) {
+		start = (((addr_t) HBLK_PAYLOAD(hbp) + align - 1) & ~(align - 1))
+		    - HBLK_HDR;
+		// the leading space has to be able to stand as a free block
+		while (start != (addr_t) hbp && start - (addr_t) hbp < HBLK_MIN)
+			start += align;
+		lead = start - (addr_t) hbp;
+		if (lead + need > hbp->size)
+			continue;
+		if (hbp->size - lead - need < delta) {
+			delta = hbp->size - lead - need;
 			found = hbp;
-			list_move(&found->lh, &hd_free->lh);
-			break;
+			best = start;
+			if (delta == 0)
+				break;
 		}
 	}
 
-	if (!found)
-		return 1;
+	if (!found && !flushed) {
+		flushed = 1;
+		if (flush_bins(heap))
+			goto retry;
+	}
+	if (!found && !grown) {
+		grown = 1;
+		if (grow_heap(heap, need + align + HBLK_MIN) == 0)
+			goto retry;
+	}
+	if (!found) {
+		log_err("no more blocks of size %d bytes aligned to %d for "
+			"heap %s\n", size, align, heap->heap_name);
+		return NULL;
+	}
 
-	// merge released block into free list
-	// handle special cases by IF statements
-	list_for_each_entry(hbp, &hd_free->lh, lh) {
-		if (hbp->base + hbp->size == found->base) {
-			// [free][found] -> [free+found]
-			found->base = hbp->base;
-			found->size += hbp->size;
-			lp = hbp;
-		} else if (hbp->base == found->base + found->size) {
-			// [found][free] -> [found+free]
-			found->size += hbp->size;
-			rp = hbp;
-		}
-		if (lp && rp)
-			break;
+	list_del(&found->lh);
+	if (best != (addr_t) found) {
+		hbp = (heap_block_t *) best;
+		set_block(hbp, found->size - (best - (addr_t) found), 0);
+		set_block(found, best - (addr_t) found, 0);
+		list_add(&found->lh, &heap->free);
+		found = hbp;
 	}
+	take_block(heap, found, need);
+
+	return HBLK_PAYLOAD(found);
+}
 
-	if (lp)
-		list_move(&lp->lh, &hd_avail->lh);
-	if (rp)
-		list_move(&rp->lh, &hd_avail->lh);
+static int __kfree(void *p, heap_desc_t * heap)
+{
+	heap_block_t *hbp = used_block(heap, p);
 
-	// TODO check if page-release is needed
+	if (hbp == NULL)
+		return 1;
+
+	// blocks of bin sizes are kept as they are for the next request, they
+	// stay used for their neighbours but another free is refused
+	if (heap->use_bins && HEAP_BINNABLE(HBLK_SIZE(hbp))) {
+		hbp->magic = HBLK_CACHED;
+		list_add(&hbp->lh, &heap->bins[HEAP_BIN_INDEX(HBLK_SIZE(hbp))]);
+		return 0;
+	}
+
+	merge_free_block(heap, hbp);
 
 	if (KLOG_DBG) {
 		printk("\n<__kfree: 0x%08X> \n", (addr_t) p);
@@ -217,22 +586,384 @@ static int __kfree(void *p, heap_desc_t * heap)
 	return 0;
 }
 
+// give blocks waiting in bins back to the free list, 0 if bins were empty
+static int flush_bins(heap_desc_t * heap)
+{
+	heap_block_t *hbp, *tmp;
+	int i, n = 0;
+
+	for (i = 0; i < HEAP_BINS; i++) {
+		list_for_each_entry_safe(hbp, tmp, &heap->bins[i], lh) {
+			list_del(&hbp->lh);
+			merge_free_block(heap, hbp);
+			n++;
+		}
+	}
+	return n;
+}
+
+// coalesce with free neighbours found by the boundary tags
+static void merge_free_block(heap_desc_t * heap, heap_block_t * found)
+{
+	heap_block_t *hbp;
+	heap_arena_t *ap;
+	size_t size = HBLK_SIZE(found), prev;
+
+	// [found][free] -> [found+free]
+	hbp = HBLK_NEXT(found);
+	if (!(hbp->size & HBLK_USED)) {
+		list_del(&hbp->lh);
+		size += hbp->size;
+	}
+
+	// [free][found] -> [free+found], the fence stops at the arena start.
+	// The header left inside must not pass for a used block
+	prev = *(size_t *) ((addr_t) found - sizeof(size_t));
+	if (!(prev & HBLK_USED)) {
+		found->magic = 0;
+		found = (heap_block_t *) ((addr_t) found - prev);
+		list_del(&found->lh);
+		size += prev;
+	}
+
+	// [fence][found][sentinel] -> frames of a grown arena
+	ap = (heap_arena_t *) ((addr_t) found - ARENA_HDR);
+	if (*ARENA_FENCE(ap) == HBLK_USED
+	    && (addr_t) found + size == ARENA_END(ap)
+	    && (addr_t) ap != heap->start) {
+		log_dbg("heap %s releases %d pages at 0x%08X\n",
+			heap->heap_name, ap->pages, ap);
+		list_del(&ap->list);
+		free_frames(heap->mmcp, ap);
+		return;
+	}
+
+	set_block(found, size, 0);
+	list_add(&found->lh, &heap->free);
+}
+
+// magazines of small blocks, only touched by their CPU with interrupts off
+typedef struct {
+	uint_t n;
+	void *objs[MAG_SIZE];
+} magazine_t;
+
+static magazine_t magazines[MAX_CPUS][HEAP_BINS];
+
+static inline magazine_t *get_magazine(uint_t bin)
+{
+	return &magazines[get_processor() - cpuset][bin];
+}
+
+static void *locked_kmalloc(size_t size, size_t align, heap_desc_t * heap)
+{
+	uint_t flags;
+	void *p;
+
+	flags = local_get_flags();
+	local_irq_disable();
+	lock_rlock(&heap->lock);
+	p = __kmalloc_aligned(size, align, heap);
+	release_rlock(&heap->lock);
+	local_set_flags(flags);
+
+	return p;
+}
+
+// blocks of the local magazines go back to the heap
+static int drain_magazines(heap_desc_t * heap)
+{
+	magazine_t *mag;
+	uint_t bin, n = 0;
+	void *p;
+
+	for (bin = 0; bin < HEAP_BINS; bin++) {
+		mag = get_magazine(bin);
+		for (; mag->n > 0; n++) {
+			p = mag->objs[--mag->n];
+			HBLK_HEADER(p)->magic = HBLK_MAGIC;
+			__kfree(p, heap);
+		}
+	}
+	return n;
+}
+
+// large and aligned requests bypass the magazines
+static void *depot_alloc(size_t size, size_t align, heap_desc_t * heap)
+{
+	uint_t flags;
+	void *p;
+
+	p = locked_kmalloc(size, align, heap);
+	if (p != NULL)
+		return p;
+
+	// free blocks may be stuck in magazines of this CPU
+	flags = local_get_flags();
+	local_irq_disable();
+	lock_rlock(&heap->lock);
+	if (drain_magazines(heap))
+		p = __kmalloc_aligned(size, align, heap);
+	release_rlock(&heap->lock);
+	local_set_flags(flags);
+	return p;
+}
+
+static void *mag_alloc(size_t size, heap_desc_t * heap)
+{
+	magazine_t *mag;
+	uint_t flags;
+	void *p;
+
+	if (size > HEAP_BIN_MAX)
+		return depot_alloc(size, HBLK_ALIGN, heap);
+
+	size = size ? (size + HEAP_BIN_SIZE - 1) & ~(HEAP_BIN_SIZE - 1)
+	    : HEAP_BIN_SIZE;
+	flags = local_get_flags();
+	local_irq_disable();
+	mag = get_magazine(HEAP_BIN_INDEX(HEAP_BIN_BLOCK(size)));
+	if (mag->n == 0) {
+		lock_rlock(&heap->lock);
+		while (mag->n < MAG_BATCH) {
+			p = __kmalloc(size, heap);
+			if (p == NULL)
+				break;
+			HBLK_HEADER(p)->magic = HBLK_CACHED;
+			mag->objs[mag->n++] = p;
+		}
+		release_rlock(&heap->lock);
+	}
+	p = mag->n > 0 ? mag->objs[--mag->n] : NULL;
+	if (p != NULL)
+		HBLK_HEADER(p)->magic = HBLK_MAGIC;
+	local_set_flags(flags);
+
+	return p;
+}
+
+static int mag_free(void *p, heap_desc_t * heap)
+{
+	heap_block_t *hbp = HBLK_HEADER(p);
+	magazine_t *mag;
+	uint_t flags;
+	void *obj;
+	int ret = 0;
+
+	// arenas can only be walked under the lock, a block of frames of the
+	// heap with a good header is checked in full once it is drained
+	if ((addr_t) hbp < (addr_t) heap->mmcp->base
+	    || (addr_t) hbp >= (addr_t) heap->mmcp->base + heap->mmcp->length
+	    || !(hbp->size & HBLK_USED))
+		return 1;
+	if (hbp->magic == HBLK_CACHED) {
+		log_err("kfree 0x%08X twice\n", p);
+		return 1;
+	}
+
+	flags = local_get_flags();
+	local_irq_disable();
+	if (!HEAP_BINNABLE(HBLK_SIZE(hbp))) {
+		lock_rlock(&heap->lock);
+		ret = __kfree(p, heap);
+		release_rlock(&heap->lock);
+		local_set_flags(flags);
+		return ret;
+	}
+
+	// a racing free of the same block on another CPU loses here
+	if (cmpxchg((addr_t *) & hbp->magic, HBLK_MAGIC, HBLK_CACHED) !=
+	    HBLK_MAGIC) {
+		local_set_flags(flags);
+		return 1;
+	}
+
+	mag = get_magazine(HEAP_BIN_INDEX(HBLK_SIZE(hbp)));
+	if (mag->n == MAG_SIZE) {
+		lock_rlock(&heap->lock);
+		while (mag->n > MAG_SIZE - MAG_BATCH) {
+			obj = mag->objs[--mag->n];
+			HBLK_HEADER(obj)->magic = HBLK_MAGIC;
+			__kfree(obj, heap);
+		}
+		release_rlock(&heap->lock);
+	}
+	mag->objs[mag->n++] = p;
+	local_set_flags(flags);
+
+	return ret;
+}
+
 static void show_heap(heap_desc_t * heap)
 {
 	heap_block_t *hbp;
+	heap_arena_t *ap;
+	int i, n;
 
-	printk("\nfree_list: ");
-	list_for_each_entry(hbp, &(heap->free->lh), lh) {
-		printk("[0x%08X]0x%08X(0x%08X) ->", hbp, hbp->base, hbp->size);
+	printk("\narenas: ");
+	list_for_each_entry(ap, &heap->arenas, list) {
+		printk("0x%08X(%d pages) ->", ap, ap->pages);
 	}
-	printk("|\nres_list: ");
-	list_for_each_entry(hbp, &(heap->res->lh), lh) {
-		printk("[0x%08X]0x%08X(0x%08X) ->", hbp, hbp->base, hbp->size);
+	printk("|\nfree_list: ");
+	list_for_each_entry(hbp, &heap->free, lh) {
+		printk("0x%08X(0x%08X) ->", hbp, hbp->size);
+	}
+	printk("|\nbins: ");
+	for (i = 0; i < HEAP_BINS; i++) {
+		n = 0;
+		list_for_each_entry(hbp, &heap->bins[i], lh)
+		    n++;
+		if (n)
+			printk("%d(%d) ", (i + 1) * HEAP_BIN_SIZE, n);
 	}
 	printk("|\n");
 }
 
-#elif INIT_HEAP == HEAP_FF
+#if HEAP_BENCH
+
+#define BENCH_HEAP_SIZE 0x40000
+#define BENCH_SLOTS     128
+#define BENCH_OPS       4096	// power of 2, cycles are averaged by shift
+#define BENCH_OPS_SHIFT 12
+
+// 4 of 5 requests are small, the rest up to 4KB
+static _u32 bench_run(heap_desc_t * heap, int use_bins, _u32 * fails)
+{
+	void *live[BENCH_SLOTS];
+	_u32 seed = 0x2545F491, n, slot, size;
+	_u64 start, cycles;
+
+	bzero(live, sizeof(live));
+	heap->use_bins = use_bins;
+	*fails = 0;
+
+	start = rdtsc();
+	for (n = 0; n < BENCH_OPS; n++) {
+		seed = seed * 1103515245 + 12345;
+		slot = (seed >> 8) % BENCH_SLOTS;
+		if (live[slot]) {
+			__kfree(live[slot], heap);
+			live[slot] = NULL;
+			continue;
+		}
+		seed = seed * 1103515245 + 12345;
+		if ((seed >> 16) % 5)
+			size = 8 + (seed >> 8) % 248;
+		else
+			size = 512 + (seed >> 8) % 3584;
+		live[slot] = __kmalloc(size, heap);
+		if (live[slot] == NULL)
+			(*fails)++;
+	}
+	cycles = rdtsc() - start;
+
+	// leave one free block for the next run
+	for (n = 0; n < BENCH_SLOTS; n++)
+		if (live[n])
+			__kfree(live[n], heap);
+	flush_bins(heap);
+
+	return (_u32) (cycles >> BENCH_OPS_SHIFT);
+}
+
+void kmalloc_bench()
+{
+	static heap_desc_t heap;
+	_u32 fit, binned, fit_fails, bin_fails;
+
+	if (init_heap(&heap, &mm_phys, "bench_heap", BENCH_HEAP_SIZE)) {
+		log_err("no memory for heap benchmark\n");
+		return;
+	}
+
+	fit = bench_run(&heap, 0, &fit_fails);
+	binned = bench_run(&heap, 1, &bin_fails);
+	printk("kmalloc bench: %d ops, best-fit %d cycles/op (%d failed), "
+	       "bins %d cycles/op (%d failed)\n", BENCH_OPS, fit, fit_fails,
+	       binned, bin_fails);
+}
+
+#endif
+
+#elif HEAP_TYPE == HEAP_TYPE_SLAB
+
+static const char *kmalloc_names[KMALLOC_CACHES] = {
+	"kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+	"kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+
+// slab allocation by size classes
+static int HEAP_SLAB(heap_desc_t * heap)
+{
+	uint_t n;
+	size_t size;
+
+	for (n = 0; n < KMALLOC_CACHES; n++) {
+		// objects are naturally aligned up to a cache line
+		size = 1 << (n + KMALLOC_MIN_SHIFT);
+		heap->caches[n] = kmem_cache_create(kmalloc_names[n], size,
+						    size < L1_CACHE_BYTES ?
+						    size : L1_CACHE_BYTES,
+						    0, NULL);
+		if (heap->caches[n] == NULL)
+			return 1;
+	}
+
+	log_info("init heap: %s ...\n %d size classes up to %d bytes\n",
+		 heap->heap_name, KMALLOC_CACHES, 1 << KMALLOC_MAX_SHIFT);
+	return 0;
+}
+
+static void *__kmalloc(size_t size, heap_desc_t * heap)
+{
+	void *p;
+	uint_t n;
+
+	if (size > (1 << KMALLOC_MAX_SHIFT))
+		p = get_free_pages(PAGE_CONTAIN(size));
+	else {
+		for (n = 0; (1 << (n + KMALLOC_MIN_SHIFT)) < size; n++) ;
+		p = kmem_cache_alloc(heap->caches[n]);
+	}
+
+	if (KLOG_DBG) {
+		printk("\n<__kmalloc: 0x%08X> \n", size);
+		show_heap(heap);
+	}
+
+	return p;
+}
+
+// a size class at least as large as align is aligned up to a cache line,
+// pages are taken for more
+static void *__kmalloc_aligned(size_t size, size_t align, heap_desc_t * heap)
+{
+	if (align > L1_CACHE_BYTES)
+		return get_free_pages(PAGE_CONTAIN(size));
+	return __kmalloc(size < align ? align : size, heap);
+}
+
+static int __kfree(void *p, heap_desc_t * heap)
+{
+	kmem_cache_t *cachep;
+
+	if (p == NULL)
+		return 1;
+
+	cachep = kmem_cache_of(p);
+	if (cachep != NULL) {
+		kmem_cache_free(cachep, p);
+		return 0;
+	}
+	return free_pages(p);
+}
+
+static void show_heap(heap_desc_t * heap)
+{
+	show_slabs();
+}
+
+#elif HEAP_TYPE == HEAP_TYPE_FF
 
 // first-fit allocation
 static int HEAP_FF(heap_desc_t * heap)
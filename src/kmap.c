@@ -0,0 +1,203 @@
+/*
+ *      Red Magic 1996 - 2015
+ *
+ *      kmap.c - temporary kernel mappings for high memory frames
+ *
+ *      2015 Lin Coin - initial version
+ */
+
+#include "common.h"
+#include "kmap.h"
+#include "mm.h"
+#include "paging.h"
+#include "cpu.h"
+#include "locking.h"
+#include "debug.h"
+#include "klog.h"
+
+typedef struct {
+	void *page;		// frame mapped in this slot, NULL if none
+	uint_t count;		// users of the mapping
+} kmap_slot_t;
+
+static kmap_slot_t kmap_slots[KMAP_PAGES];
+static uint_t kmap_next;
+static spinlock_t kmap_lock;
+
+// page entries of the kmap window, they are all in one page table
+static page_entry_t *kmap_ptes;
+
+// busy atomic slots of each CPU
+static _u32 kmap_atomic_busy[MAX_CPUS];
+// preemption state before the first slot was taken, preempt_disable()
+// does not nest
+static uint_t kmap_atomic_preempt[MAX_CPUS];
+
+static void kmap_flush_unused();
+
+#define KMAP_VADDR(idx) (KMAP_BASE + (idx) * PAGE_SIZE)
+#define KMAP_INDEX(va)  (((_u32)(va) - KMAP_BASE) / PAGE_SIZE)
+
+// frames in the direct map are already accessible
+#define DIRECT_MAPPED(page) ((_u32)(page) < get_high_mem_start())
+
+void init_kmap()
+{
+	void *va = (void *)KMAP_BASE;
+
+	ASSERT(KMAP_PAGES + MAX_CPUS * KM_SLOTS_P_CPU <= PTE_NUM_P_TBL);
+	ASSERT(KM_SLOTS_P_CPU <= sizeof(_u32) * 8);
+
+	// map and unmap once so that the page table of the window is linked
+	// into k_pdir and shared by all page directories created later
+	if (page_map(va, NULL, k_pdir, NULL) != OK)
+		PANIC("kmap window setup failed");
+	page_unmap(va, k_pdir);
+	kmap_ptes = get_page_entry(va, k_pdir);
+
+	spin_lock_init(&kmap_lock);
+}
+
+void *kmap(void *page)
+{
+	kmap_slot_t *slot;
+	uint_t n, idx;
+	void *va = NULL;
+
+	page = (void *)((_u32) page & PAGE_MASK);
+	if (DIRECT_MAPPED(page))
+		return (void *)__phys_to_virt_lm(NULL, (_u32) page);
+
+	spin_lock(&kmap_lock);
+
+	// reuse an existing mapping of the frame
+	for (n = 0; n < KMAP_PAGES; n++) {
+		slot = &kmap_slots[n];
+		if (slot->page == page) {
+			slot->count++;
+			va = (void *)KMAP_VADDR(n);
+			goto out;
+		}
+	}
+
+	for (n = 0; n < KMAP_PAGES; n++) {
+		idx = kmap_next++;
+		if (kmap_next == KMAP_PAGES) {
+			kmap_next = 0;
+			kmap_flush_unused();
+		}
+
+		slot = &kmap_slots[idx];
+		if (slot->page == NULL) {
+			slot->page = page;
+			slot->count = 1;
+			kmap_ptes[idx] = (page_entry_t) ((_u32) page |
+							 PAGE_KERNEL) | page_nx;
+			va = (void *)KMAP_VADDR(idx);
+			goto out;
+		}
+	}
+	log_err(LOG_MM "no kmap slot for 0x%08X\n", page);
+
+      out:
+	spin_unlock(&kmap_lock);
+	return va;
+}
+
+void kunmap(void *vaddr)
+{
+	kmap_slot_t *slot;
+
+	if ((_u32) vaddr < KMAP_BASE || (_u32) vaddr >= KMAP_ATOMIC_BASE)
+		return;
+
+	spin_lock(&kmap_lock);
+	slot = &kmap_slots[KMAP_INDEX(vaddr)];
+	ASSERT(slot->count > 0);
+	slot->count--;
+	spin_unlock(&kmap_lock);
+}
+
+// unused mappings are dropped lazily when the slots wrap around, stale TLB
+// entries on all processors go with one flush
+static void kmap_flush_unused()
+{
+	uint_t n;
+
+	for (n = 0; n < KMAP_PAGES; n++) {
+		if (kmap_slots[n].page != NULL && kmap_slots[n].count == 0) {
+			kmap_slots[n].page = NULL;
+			kmap_ptes[n] = 0;
+		}
+	}
+
+	flush_tlb_range((void *)KMAP_BASE, KMAP_PAGES);
+	smp_flush_tlb_others();
+}
+
+void *kmap_atomic(void *page)
+{
+	page = (void *)((_u32) page & PAGE_MASK);
+	if (DIRECT_MAPPED(page))
+		return (void *)__phys_to_virt_lm(NULL, (_u32) page);
+
+	return kmap_atomic_pfn((_u32) page >> 12);
+}
+
+// frames above 4GB in PAE mode are only reachable by frame number
+void *kmap_atomic_pfn(_u32 pfn)
+{
+	cpu_state_t *cpu;
+	_u32 *busy;
+	uint_t flags, slot, idx;
+
+	// the thread stays on this processor until kunmap_atomic
+	flags = local_get_flags();
+	local_irq_disable();
+	cpu = get_processor();
+	busy = &kmap_atomic_busy[cpu - cpuset];
+	if (*busy == 0)
+		kmap_atomic_preempt[cpu - cpuset] = cpu->preempt_on;
+	preempt_disable();
+
+	for (slot = 0; slot < KM_SLOTS_P_CPU; slot++)
+		if (!(*busy & (1 << slot)))
+			break;
+	if (slot == KM_SLOTS_P_CPU)
+		PANIC("kmap_atomic slots exhausted");
+	*busy |= 1 << slot;
+	local_set_flags(flags);
+
+	// the slot is only used by this processor, a local flush is enough
+	idx = KMAP_PAGES + (cpu - cpuset) * KM_SLOTS_P_CPU + slot;
+	kmap_ptes[idx] = ((page_entry_t) pfn << 12) | PAGE_KERNEL | page_nx;
+	flush_tlb_range((void *)KMAP_VADDR(idx), 1);
+
+	return (void *)KMAP_VADDR(idx);
+}
+
+void kunmap_atomic(void *vaddr)
+{
+	cpu_state_t *cpu;
+	uint_t flags, idx;
+
+	if ((_u32) vaddr < KMAP_ATOMIC_BASE
+	    || (_u32) vaddr >= KMAP_BASE + PTE_NUM_P_TBL * PAGE_SIZE)
+		return;
+
+	cpu = get_processor();
+	idx = KMAP_INDEX(vaddr);
+	ASSERT((idx - KMAP_PAGES) / KM_SLOTS_P_CPU == cpu - cpuset);
+
+	kmap_ptes[idx] = 0;
+	flush_tlb_range(vaddr, 1);
+
+	flags = local_get_flags();
+	local_irq_disable();
+	kmap_atomic_busy[cpu - cpuset] &= ~(1 << (idx - KMAP_PAGES) %
+					    KM_SLOTS_P_CPU);
+	if (kmap_atomic_busy[cpu - cpuset] == 0
+	    && kmap_atomic_preempt[cpu - cpuset])
+		preempt_enable();
+	local_set_flags(flags);
+}
@@ -60,6 +60,7 @@ volatile uint_t *lapic_regp = NULL;
 
 static void lapic_write(int index, int value);
 static void lapic_set_timer(uint_t icr);
+static void lapic_irq_inval_tlb_handler(registers_t * regs);
 static void lapic_irq_stop_cpu_handler(registers_t * regs);
 
 static void lapic_write(int index, int value)
@@ -114,6 +115,7 @@ void init_local_apic()
 
 	// register IPI command handlers
 	register_interrupt_handler(IRQ_STOP_CPU, &lapic_irq_stop_cpu_handler);
+	register_interrupt_handler(IRQ_INVAL_TLB, &lapic_irq_inval_tlb_handler);
 }
 
 // Acknowledge interrupt.
@@ -223,6 +225,11 @@ void lapic_send_ipi_self(int vector)
 	lapic_write(ICRLO, cfg);
 }
 
+static void lapic_irq_inval_tlb_handler(registers_t * regs)
+{
+	smp_flush_tlb_check();
+}
+
 static void lapic_irq_stop_cpu_handler(registers_t * regs)
 {
 	printk("CPU #%u received IRQ_STOP_CPU, stopped.\n", lapic_get_id());
@@ -19,6 +19,10 @@
 #include "cpu.h"
 #include "string.h"
 #include "device.h"
+#include "kmap.h"
+#include "swap.h"
+#include "slab.h"
+#include "memblock.h"
 
 multiboot_t *mbootp;
 
@@ -39,6 +43,9 @@ int main(multiboot_t * mbp)
 	mbootp = mbp;
 	init_debug(mbp);
 
+	// early allocations until mm_phys is set up
+	init_memblock(mbp);
+
 	// reset text-mode
 	c80_clear();
 	printk_color(rc_black, rc_red, "\t\t\t\tRed Magic\n");
@@ -60,10 +67,16 @@ int main(multiboot_t * mbp)
 	show_kernel_pos();
 	show_ARDS_from_multiboot(mbp);
 	init_paging();
+	init_kmap();
+	init_slab();
 	init_kheap();
+#if HEAP_BENCH && HEAP_TYPE == HEAP_TYPE_FB
+	kmalloc_bench();
+#endif
 
 	// initialize devices and rootfs
 	init_dev();
+	init_swap();
 	//init_root_fs();
 
 	// start all APs
@@ -78,6 +91,8 @@ int main(multiboot_t * mbp)
 
 	// initialize kernel task and scheduling
 	setup_init_task();
+	create_kernel_task(kzerod, NULL);
+	create_kernel_task(kswapd, NULL);
 	init_sched();
 
 	// All our initialisation calls will go in here.
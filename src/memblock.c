@@ -0,0 +1,108 @@
+/*
+ *      Red Magic 1996 - 2015
+ *
+ *      memblock.c - bump allocation from the multiboot memory map at boot
+ *
+ *      2015 Lin Coin - initial version
+ */
+
+#include "common.h"
+#include "memblock.h"
+#include "elf.h"
+#include "mm.h"
+#include "paging.h"
+#include "string.h"
+#include "klog.h"
+#include "debug.h"
+
+static addr_t mb_cur, mb_end;
+static int mb_released;
+
+// boot loader data may follow the kernel image, keep clear of it. The
+// section headers and the symbol and string tables they point to are read
+// by elf_from_multiboot() later on
+static addr_t boot_data_end(multiboot_t * mbp, addr_t floor)
+{
+	multiboot_module_t *mod;
+	elf_section_header_t *sh;
+	_u32 n;
+
+	if ((addr_t) mbp + sizeof(multiboot_t) > floor)
+		floor = (addr_t) mbp + sizeof(multiboot_t);
+	if (mbp->mmap_addr + mbp->mmap_length > floor)
+		floor = mbp->mmap_addr + mbp->mmap_length;
+
+	if (mbp->num > 0 && mbp->addr + mbp->num * mbp->size > floor)
+		floor = mbp->addr + mbp->num * mbp->size;
+	for (n = 0; n < mbp->num; n++) {
+		sh = (elf_section_header_t *) (mbp->addr + n * mbp->size);
+		if (sh->addr != 0 && sh->addr + sh->size > floor)
+			floor = sh->addr + sh->size;
+	}
+
+	mod = (multiboot_module_t *) mbp->mods_addr;
+	for (n = 0; n < mbp->mods_count; n++, mod++) {
+		if ((addr_t) (mod + 1) > floor)
+			floor = (addr_t) (mod + 1);
+		if (mod->mod_end > floor)
+			floor = mod->mod_end;
+	}
+	return floor;
+}
+
+void init_memblock(multiboot_t * mbp)
+{
+	mmap_entry_t *mmap = (mmap_entry_t *) mbp->mmap_addr;
+	addr_t floor, lo, hi;
+
+	floor = boot_data_end(mbp, (addr_t) k_end);
+	for (; (_u32) mmap < mbp->mmap_addr + mbp->mmap_length; mmap++) {
+		if (mmap->type != ARDS_TYPE_AVAIL || mmap->base_addr_high)
+			continue;
+
+		lo = mmap->base_addr_low;
+		hi = lo + mmap->length_low;
+		if (mmap->length_high || hi < lo || hi > K_SPACE_END)
+			hi = K_SPACE_END;
+		if (lo < floor)
+			lo = floor;
+		if (lo < hi && hi - lo > mb_end - mb_cur) {
+			mb_cur = lo;
+			mb_end = hi;
+		}
+	}
+
+	if (mb_cur == mb_end)
+		PANIC("No memory for memblock");
+}
+
+void *memblock_alloc(size_t size, size_t align)
+{
+	addr_t p;
+
+	if (mb_released) {
+		log_err(LOG_MM "memblock_alloc after release\n");
+		return NULL;
+	}
+	if (align < sizeof(addr_t))
+		align = sizeof(addr_t);
+
+	p = (mb_cur + align - 1) & ~(align - 1);
+	if (p < mb_cur || mb_end - p < size) {
+		log_err(LOG_MM "memblock: no %d bytes\n", size);
+		return NULL;
+	}
+	mb_cur = p + size;
+	bzero((void *)p, size);
+
+	return (void *)p;
+}
+
+void memblock_release(addr_t * start, addr_t * end)
+{
+	mb_released = 1;
+	*start = PAGE_ALIGN(mb_cur);
+	*end = mb_end & PAGE_MASK;
+	if (*start > *end)
+		*start = *end;
+}
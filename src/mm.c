@@ -14,6 +14,15 @@
 #include "heap.h"
 #include "boot.h"
 #include "klog.h"
+#include "cpu.h"
+#include "sched.h"
+#include "kmap.h"
+#include "vmalloc.h"
+#include "task.h"
+#include "locking.h"
+#include "swap.h"
+#include "vma.h"
+#include "memblock.h"
 
 void show_kernel_pos()
 {
@@ -51,14 +60,17 @@ void get_mem_info_from_multiboot(multiboot_t * mbp, mem_info_t * minfo)
 	_u32 mmap_addr = mbp->mmap_addr;
 	_u32 mmap_length = mbp->mmap_length;
 
-	_u32 mem_total;
-	_u32 mem_avail;
+	_u64 mem_total = 0;
+	_u64 mem_avail = 0;
+	_u64 len;
 
 	addr_range_t *mmap = (addr_range_t *) mmap_addr;
-	addr_range_t *p = minfo->mmap_entries;
+	addr_range_t *p;
 
-	// too many ARDSs? just increase MAX_ARDS_ENT in mm.h!
-	ASSERT(MAX_ARDS_ENT < mmap_length);
+	p = memblock_alloc(mmap_length, sizeof(_u32));
+	if (p == NULL)
+		PANIC("No memory for ARDS");
+	minfo->mmap_entries = p;
 	minfo->mmap_length = mmap_length;
 
 	// calculate how many pages available
@@ -71,13 +83,15 @@ void get_mem_info_from_multiboot(multiboot_t * mbp, mem_info_t * minfo)
 		p->length_low = (_u32) mmap->length_low;
 		p->type = (_u32) mmap->type;
 
-		mem_total += (_u32) mmap->length_low;
+		len = ((_u64) mmap->length_high << 32) | mmap->length_low;
+		mem_total += len;
 		if ((_u32) mmap->type == ARDS_TYPE_AVAIL)
-			mem_avail += (_u32) mmap->length_low;
+			mem_avail += len;
 	}
 
-	minfo->total_memory = mem_total;
-	minfo->avail_memory = mem_avail;
+	// in KB, bytes overflow 32 bits with memory above 4GB
+	minfo->total_memory = (_u32) (mem_total >> 10);
+	minfo->avail_memory = (_u32) (mem_avail >> 10);
 }
 
 // spaces for page tables are allocated when needed, good news is each page
@@ -85,12 +99,82 @@ void get_mem_info_from_multiboot(multiboot_t * mbp, mem_info_t * minfo)
 static mmc_t mm_pgtbls;
 static mem_info_t minfo;
 static void page_fault_handler(registers_t * regs);
+static void do_page_fault(registers_t * regs, _u32 cr2);
 
 // following static functions have specific argument - flush that will refresh
 // page cache for CPU
 static int __page_map(void *virt_addr, void *phys_addr, page_directory_t * pdir,
-		      mmc_t * mp, int flush);
+		      mmc_t * mp, page_entry_t flags, int flush);
 static int __page_unmap(void *virt_addr, page_directory_t * pdir, int flush);
+static int __page_map_range(void *virt_addr, void *phys_addr, size_t npg,
+			    page_directory_t * pdir, mmc_t * mp,
+			    page_entry_t flags, int flush);
+static int __page_map_pfn_range(void *virt_addr, _u32 pfn, size_t npg,
+				page_directory_t * pdir, mmc_t * mp,
+				page_entry_t flags, int flush);
+static int __page_unmap_range(void *virt_addr, size_t npg,
+			      page_directory_t * pdir, int flush);
+static page_table_t *__get_page_table(void *virt_addr, page_directory_t * pdir,
+				      mmc_t * mp, page_entry_t flags);
+static page_table_t *__lookup_page_table(void *virt_addr,
+					 page_directory_t * pdir);
+static void __put_page_table(void *virt_addr, page_directory_t * pdir,
+			     page_table_t * ptp, _u32 nr);
+static int is_user_addr(_u32 addr);
+static int is_phys_frame(void *phys);
+static page_entry_t page_flags_by_addr(void *virt_addr);
+
+// frame descriptors of mm_phys and frames accounted to each owner
+static page_t *mem_map;
+static size_t nr_owned[PGO_MAX];
+static void init_mem_map();
+static void mem_map_alloc(_u32 idx, _u32 npg);
+static void mem_map_free(_u32 idx, _u32 npg);
+
+// compaction of mm_phys, frames in the window [first, last) are moved out
+typedef struct {
+	_u32 first;
+	_u32 last;
+	_u32 left;		// movable frames still in the window
+} compact_ctl_t;
+static int is_movable(page_t * page);
+static int find_compact_window(_u32 npg, _u32 * first, _u32 * nmov);
+static void compact_addr_space(page_directory_t * pdir, void *arg);
+static int migrate_page(page_directory_t * pdir, _u32 va,
+			page_entry_t * ptep, compact_ctl_t * cc);
+static void *alloc_frame_outside(mmc_t * mmcp, _u32 first, _u32 last);
+static int do_cow_fault(page_directory_t * pdir, _u32 addr);
+static int do_demand_fault(page_directory_t * pdir, _u32 addr, int write,
+			   page_entry_t flags, _u32 lo, _u32 hi);
+static int do_user_fault(page_directory_t * pdir, _u32 addr, _u32 err);
+static int do_swap_fault(page_directory_t * pdir, _u32 addr);
+static void *alloc_user_page(int zero);
+static void set_anon_rmap(page_t * page, page_directory_t * pdir, _u32 va);
+static int sync_kernel_pde(page_directory_t * pdir, _u32 addr);
+static void init_pdpt(page_directory_t * pdir);
+
+// offset of PDPT in page directory, CR3 points there in PAE mode
+#define PGD_PDPT_OFFSET ((_u32) &((page_directory_t *) 0)->pdpt)
+
+// NX bit set on kernel data mappings, 0 if not supported
+page_entry_t page_nx;
+
+// read-only page full of zeros shared by all read faults, a real frame is
+// only allocated on the first write through COW fault
+static void *zero_page;
+
+// pre-zeroed page pools
+static void *zpool_pop();
+static void zpool_refill();
+static uint_t zpool_count(shrinker_t * shrinker);
+static uint_t zpool_scan(shrinker_t * shrinker, uint_t nr);
+static shrinker_t zpool_shrinker = {
+	.count = zpool_count,
+	.scan = zpool_scan
+};
+
+// set if CR4.PGE is switched on, kernel mappings are then global
+static int pge_enabled;
 
 // this mmc will manage use of frames for actual physical memory, we can get
 // physical memory usage and frame contents via series of interfaces.
@@ -99,11 +183,20 @@ mmc_t mm_phys;
 
 void *get_free_pages(size_t npg)
 {
-	return alloc_frames(&mm_phys, npg);
+	void *p;
+
+	if (mm_phys.nfree < WMARK_MIN + npg)
+		shrink_caches(npg);
+	p = alloc_frames(&mm_phys, npg);
+	if (p == NULL && npg > 1 && compact_frames(npg) == OK)
+		p = alloc_frames(&mm_phys, npg);
+	return p;
 }
 
 void *get_free_page()
 {
+	if (mm_phys.nfree < WMARK_MIN + 1)
+		shrink_caches(1);
 	return alloc_frame(&mm_phys);
 }
 
@@ -111,6 +204,11 @@ void *get_zeroed_page()
 {
 	void *p;
 
+	p = zpool_pop();
+	if (p)
+		return p;
+
+	// pool is drained, fall back to zero the frame synchronously
 	p = alloc_frame(&mm_phys);
 	if (p)
 		bzero(p, PAGE_SIZE);
@@ -128,35 +226,213 @@ int free_page(void *page)
 	return 0;
 }
 
-// this mmc is for high memroy management, high memory is not mapped in page
-// tables, so we should setup a few pages for mm meta data first.
-static mmc_t *mmp_high;
+// each processor keeps a small pool of pre-zeroed frames so that
+// get_zeroed_page() is mostly a pop, kzerod refills the pools in background
+typedef struct {
+	rawlock_t lock;
+	uint_t nr;
+	void *frames[ZPOOL_PAGES];
+} zpool_t;
+
+static zpool_t zpools[MAX_CPUS];
+
+// the pool lock is taken with interrupts off and without touching preempt
+// state, so it is safe to get zeroed pages before scheduling starts
+static inline uint_t zpool_lock(zpool_t * zp)
+{
+	uint_t flags;
+
+	flags = local_get_flags();
+	local_irq_disable();
+	lock_rlock(&zp->lock);
+
+	return flags;
+}
+
+static inline void zpool_unlock(zpool_t * zp, uint_t flags)
+{
+	release_rlock(&zp->lock);
+	local_set_flags(flags);
+}
+
+static void *zpool_pop()
+{
+	cpu_state_t *cpu;
+	zpool_t *zp;
+	uint_t flags;
+	void *p = NULL;
+
+	cpu = get_processor();
+	if (cpu == NULL)
+		return NULL;
+	zp = &zpools[cpu - cpuset];
+
+	flags = zpool_lock(zp);
+	if (zp->nr > 0)
+		p = zp->frames[--zp->nr];
+	zpool_unlock(zp, flags);
+
+	return p;
+}
+
+// zero a page with non-temporal stores, pre-zeroed frames are not going to
+// be touched soon so there is no point in polluting the cache with them
+static void zero_page_nt(void *page)
+{
+	static int has_sse2 = -1;
+	_u32 *p = (_u32 *) page;
+	_u32 *end = p + PAGE_SIZE / sizeof(_u32);
+
+	if (has_sse2 < 0)
+		has_sse2 = cpu_has_feature_edx(CPUID_FEAT_EDX_SSE2);
+	if (!has_sse2) {
+		bzero(page, PAGE_SIZE);
+		return;
+	}
+
+	for (; p < end; p += 4)
+		asm volatile ("movnti %1, 0(%0)\n\t"
+			      "movnti %1, 4(%0)\n\t"
+			      "movnti %1, 8(%0)\n\t"
+			      "movnti %1, 12(%0)"::"r" (p), "r"(0):"memory");
+	asm volatile ("sfence":::"memory");
+}
+
+// fill up the pools of all processors, stop when physical memory is low so
+// the pools never starve real allocations
+static void zpool_refill()
+{
+	zpool_t *zp;
+	uint_t flags;
+	void *p;
+	int n;
+
+	for (n = 0; n < mpinfo.ncpu; n++) {
+		zp = &zpools[n];
+		while (zp->nr < ZPOOL_PAGES) {
+			if (mm_phys.nfree < ZPOOL_MIN_FREE)
+				return;
+			p = alloc_frame(&mm_phys);
+			if (p == NULL)
+				return;
+			zero_page_nt(p);
+
+			flags = zpool_lock(zp);
+			if (zp->nr < ZPOOL_PAGES) {
+				zp->frames[zp->nr++] = p;
+				p = NULL;
+			}
+			zpool_unlock(zp, flags);
+
+			// someone else filled the pool meanwhile
+			if (p != NULL)
+				free_frames(&mm_phys, p);
+		}
+	}
+}
+
+// pooled pages are handed back under memory pressure, kzerod will not
+// refill them till free frames come back over ZPOOL_MIN_FREE
+static uint_t zpool_count(shrinker_t * shrinker)
+{
+	uint_t n, count = 0;
+
+	for (n = 0; n < mpinfo.ncpu; n++)
+		count += zpools[n].nr;
+	return count;
+}
+
+static uint_t zpool_scan(shrinker_t * shrinker, uint_t nr)
+{
+	zpool_t *zp;
+	uint_t flags, n, freed = 0;
+	void *p;
+
+	for (n = 0; n < mpinfo.ncpu && freed < nr; n++) {
+		zp = &zpools[n];
+		for (;;) {
+			flags = zpool_lock(zp);
+			p = (zp->nr > 0 && freed < nr) ? zp->frames[--zp->nr] :
+			    NULL;
+			zpool_unlock(zp, flags);
+			if (p == NULL)
+				break;
+			free_frames(&mm_phys, p);
+			freed++;
+		}
+	}
+
+	return freed;
+}
+
+// background thread for pre-zeroing pages
+int kzerod(void *args)
+{
+	for (;;) {
+		zpool_refill();
+		pause(1);
+	}
+
+	return 0;
+}
+
+// these mmcs are for high memory frames which are beyond the direct map, the
+// frames are not mapped in page tables, so their meta data is kept in pages
+// from mm_phys. Use kmap() to access them
+static mmc_t mm_high[MAX_HMEM_ZONES];
+static uint_t nr_high_zones;
 static addr_vec_t high_mem;
 
+// physical ranges left out of the direct map, recorded by init_paging before
+// mm_phys is available
+static addr_vec_t high_frames[MAX_HMEM_ZONES];
+static void add_high_frames(_u32 base, size_t npg);
+static void init_high_frames();
+
 void *get_free_pages_high(size_t npg)
 {
-	return alloc_frames(mmp_high, npg);
+	void *p;
+	uint_t n;
+
+	for (n = 0; n < nr_high_zones; n++) {
+		p = alloc_frames(&mm_high[n], npg);
+		if (p != NULL)
+			return p;
+	}
+	return NULL;
 }
 
 void *get_free_page_high()
 {
-	return alloc_frame(mmp_high);
+	return get_free_pages_high(1);
 }
 
 void *get_zeroed_page_high()
 {
-	void *p;
+	void *p, *va;
 
-	p = alloc_frame(mmp_high);
-	if (p)
-		bzero(p, PAGE_SIZE);
+	p = get_free_page_high();
+	if (p) {
+		va = kmap_atomic(p);
+		bzero(va, PAGE_SIZE);
+		kunmap_atomic(va);
+	}
 	return p;
 }
 
 int free_pages_high(void *page)
 {
-	// TODO need to free __phys_page in mm_phys accordingly
-	return free_frames(mmp_high, page);
+	mmc_t *mmcp;
+	uint_t n;
+
+	for (n = 0; n < nr_high_zones; n++) {
+		mmcp = &mm_high[n];
+		if ((_u32) page >= (_u32) mmcp->frame_base
+		    && (_u32) page < (_u32) mmcp->frame_base +
+		    mmcp->nframes * PAGE_SIZE)
+			return free_frames(mmcp, page);
+	}
+	return 1;
 }
 
 // TODO can just allocate one page
@@ -165,8 +441,181 @@ int free_page_high(void *page)
 	return 0;
 }
 
+// frames above 4GB, one bit per frame, set when in use
+typedef struct pfn_zone {
+	_u32 base;		// first pfn
+	_u32 npg;
+	_u32 nfree;
+	_u32 *bitmap;
+} pfn_zone_t;
+
+static pfn_zone_t pfn_zones[MAX_PFN_ZONES];
+static uint_t nr_pfn_zones;
+#if PAGING_MODE == PAGING_PAE
+static rawlock_t pfn_zone_lock;	// bitmaps and nfree, irqsave
+#endif
+
+// clamp an ARDS to the 32-bit space, frames above 4GB go to the pfn zones
+// if PAE can reach them. returns non-zero if nothing is left below 4GB
+static int split_at_4g(addr_range_t * mp, _u32 * start, _u32 * end)
+{
+	_u64 base, len, top;
+
+	base = ((_u64) mp->base_addr_high << 32) | mp->base_addr_low;
+	len = ((_u64) mp->length_high << 32) | mp->length_low;
+	top = base + len;
+
+#if PAGING_MODE == PAGING_PAE
+	if (top > 0x100000000ULL && nr_pfn_zones < MAX_PFN_ZONES) {
+		_u64 b = base > 0x100000000ULL ? base : 0x100000000ULL;
+
+		pfn_zones[nr_pfn_zones].base = (_u32) ((b + PAGE_SIZE - 1) >> 12);
+		pfn_zones[nr_pfn_zones].npg = (_u32) (top >> 12) -
+		    pfn_zones[nr_pfn_zones].base;
+		if ((_s32) pfn_zones[nr_pfn_zones].npg > 0)
+			nr_pfn_zones++;
+	}
+#endif
+	if (base >= 0x100000000ULL)
+		return 1;
+	*start = (_u32) base;
+	*end = top >= 0x100000000ULL ? 0xFFFFF000 : (_u32) top;
+	return 0;
+}
+
+static void init_pfn_zones()
+{
+	pfn_zone_t *z;
+	uint_t n;
+	size_t len;
+
+	for (n = 0; n < nr_pfn_zones; n++) {
+		z = &pfn_zones[n];
+		len = PAGE_CONTAIN((z->npg + 31) / 32 * sizeof(_u32));
+		z->bitmap = alloc_frames(&mm_phys, len);
+		if (z->bitmap == NULL)
+			PANIC("No frames for pfn zone bitmap");
+		bzero(z->bitmap, len * PAGE_SIZE);
+		z->nfree = z->npg;
+		log_info(LOG_MM "%d frames above 4GB at pfn 0x%X\n", z->npg,
+			 z->base);
+	}
+}
+
+// pfn 0 is never high memory
+_u32 get_free_pfn_high()
+{
+	void *p;
+#if PAGING_MODE == PAGING_PAE
+	pfn_zone_t *z;
+	uint_t n, flags;
+	_u32 i;
+#endif
+
+	p = get_free_page_high();
+	if (p != NULL)
+		return (_u32) p >> 12;
+
+#if PAGING_MODE == PAGING_PAE
+	flags = local_get_flags();
+	local_irq_disable();
+	lock_rlock(&pfn_zone_lock);
+	for (n = 0; n < nr_pfn_zones; n++) {
+		z = &pfn_zones[n];
+		if (z->nfree == 0)
+			continue;
+		for (i = 0; i < z->npg; i++) {
+			if (z->bitmap[i / 32] == 0xFFFFFFFF) {
+				i += 31;
+				continue;
+			}
+			if (!(z->bitmap[i / 32] & (1 << (i % 32)))) {
+				z->bitmap[i / 32] |= 1 << (i % 32);
+				z->nfree--;
+				release_rlock(&pfn_zone_lock);
+				local_set_flags(flags);
+				return z->base + i;
+			}
+		}
+	}
+	release_rlock(&pfn_zone_lock);
+	local_set_flags(flags);
+#endif
+	return 0;
+}
+
+// 1 if the frame is not high memory
+int free_pfn_high(_u32 pfn)
+{
+#if PAGING_MODE == PAGING_PAE
+	pfn_zone_t *z;
+	uint_t n, flags;
+	_u32 i;
+#endif
+
+	if (pfn < 0x100000)
+		return free_pages_high((void *)(pfn << 12));
+
+#if PAGING_MODE == PAGING_PAE
+	flags = local_get_flags();
+	local_irq_disable();
+	lock_rlock(&pfn_zone_lock);
+	for (n = 0; n < nr_pfn_zones; n++) {
+		z = &pfn_zones[n];
+		if (pfn < z->base || pfn >= z->base + z->npg)
+			continue;
+		i = pfn - z->base;
+		ASSERT(z->bitmap[i / 32] & (1 << (i % 32)));
+		z->bitmap[i / 32] &= ~(1 << (i % 32));
+		z->nfree++;
+		release_rlock(&pfn_zone_lock);
+		local_set_flags(flags);
+		return OK;
+	}
+	release_rlock(&pfn_zone_lock);
+	local_set_flags(flags);
+#endif
+	log_warn(LOG_MM "pfn 0x%X is not high memory\n", pfn);
+	return 1;
+}
+
+// direct map stops at K_DMAP_END, keep the rest for high memory zones
+static void add_high_frames(_u32 base, size_t npg)
+{
+	if (npg < 2)
+		return;
+	if (nr_high_zones >= MAX_HMEM_ZONES) {
+		log_warn(LOG_MM "too many high memory zones, 0x%08X dropped\n",
+			 base);
+		return;
+	}
+
+	high_frames[nr_high_zones].base = base;
+	high_frames[nr_high_zones].length = npg;
+	nr_high_zones++;
+}
+
+static void init_high_frames()
+{
+	_u32 *meta;
+	uint_t n;
+	size_t npg;
+
+	for (n = 0; n < nr_high_zones; n++) {
+		npg = high_frames[n].length;
+		meta = alloc_frames(&mm_phys, PAGE_CONTAIN(npg * META_ENT_SIZE));
+		if (meta == NULL)
+			PANIC("No frames for high memory meta data");
+		if (MM_PAGE_TABLE_OFFPAGE(&mm_high[n], meta,
+					  (void *)high_frames[n].base, npg))
+			PANIC("High memory init failed");
+	}
+}
+
+// user space starts here, no page table is shared with the kernel below
 static inline void set_high_mem(addr_t addr, size_t len)
 {
+	ASSERT((addr & (PGDIR_SIZE - 1)) == 0);
 	high_mem.base = addr;
 	high_mem.length = len;
 }
@@ -181,14 +630,6 @@ inline size_t get_high_mem_len()
 	return high_mem.length;
 }
 
-// notice this is inline function inside init_paging, make sure it is called
-// AFTER paging takes effect
-static inline int init_high_mem()
-{
-	return INIT_MM(mmp_high, (void *)get_high_mem_start(),
-		       get_high_mem_len());
-}
-
 // page directories begin from 0x00
 // page tables follow up with the end of page directories
 // refer to detailed mapping chart in paging.h
@@ -200,29 +641,39 @@ void init_paging()
 	page_table_t *ptp;
 	addr_range_t *mp;
 	void *p, *va, *_va;
-	_u32 map_start, map_end;
+	_u32 map_start, map_end, npg, dmap_end;
+	addr_t mb_start, mb_end;
 
-	// get memory map from multiboot struct
+	// get memory map from multiboot struct, it is the last early
+	// allocation, the rest of memblock goes to mm_phys
 	bzero((void *)&minfo, sizeof(mem_info_t));
 	get_mem_info_from_multiboot(mbootp, &minfo);
+	memblock_release(&mb_start, &mb_end);
 
 	// kernel PDE/PTEs end before section text
 	pgtbls_end = (_u32) k_start;
 
-	// stop! space not enough, we need PGD_MAX page_directory_t entries 
-	// and at least 5 free frames)
-	ASSERT(PGD_BASE + sizeof(page_directory_t) * PGD_MAX + PAGE_SIZE * 5 <=
+	// stop! space not enough, we need the kernel page directory and at
+	// least 5 free frames for boot-time page tables, page directories of
+	// tasks and page tables created later come from mm_phys
+	ASSERT(PGD_BASE + sizeof(page_directory_t) + PAGE_SIZE * 5 <=
 	       pgtbls_end);
 
-	// initialize page directory tables
+	// initialize kernel page directory
 	pdp = (page_directory_t *) PGD_BASE;
-	for (i = 0; i < PGD_MAX; i++) {
-		bzero((void *)pdp, sizeof(page_directory_t));
-	}
+	bzero((void *)pdp, sizeof(page_directory_t));
+	init_pdpt(pdp);
+
+	// NX is only there with 64-bit entries
+	if (PAGING_MODE == PAGING_PAE
+	    && cpu_has_feature_ext_edx(CPUID_EXT_EDX_NX))
+		page_nx = PAGE_NX;
+	if (PAGING_MODE == PAGING_PAE && !cpu_has_feature_edx(CPUID_FEAT_EDX_PAE))
+		PANIC("PAE is not supported");
 
 	// initialize page tables areas
 	log_info("init memory for page tables ...\n");
-	if (INIT_MM(&mm_pgtbls, (void *)&pdp[i], pgtbls_end - (_u32) & pdp[i]))
+	if (INIT_MM(&mm_pgtbls, (void *)&pdp[1], pgtbls_end - (_u32) & pdp[1]))
 		PANIC("MM_INIT failed");
 
 	// begin to initialize paging for kernel space
@@ -237,47 +688,73 @@ void init_paging()
 
 		// init PDE
 		pdp[PGD_IDX_KERNEL].tables[PDE_INDEX(p)] =
-		    (page_table_t *) ((_u32) ptp | PAGE_PRESENT | PAGE_WRITE |
-				      PAGE_USER);
+		    (_u32) ptp | PAGE_PRESENT | PAGE_WRITE;
 
-		// init PTE : 1024 pages per PT
+		// init PTE : PTE_NUM_P_TBL pages per PT
 		bzero((void *)ptp, sizeof(page_table_t));
-		for (i = ((_u32) p >> 12) % 1024; i < 1024; i++) {
+		for (i = PTE_INDEX(p); i < PTE_NUM_P_TBL; i++) {
 			ptp->pages[PTE_INDEX(p)] =
-			    (page_entry_t) ((_u32) p | PAGE_PRESENT |
-					    PAGE_WRITE | PAGE_USER);
+			    (page_entry_t) ((_u32) p | PAGE_KERNEL);
 
 			// next page entry
 			p = (void *)((_u32) p + PAGE_SIZE);
 		}
 	}
 
+	// boot-time page tables may run out before K_DMAP_END with PAE, each
+	// ARDS can start one more table than its size needs
+	dmap_end = PGDIR_ALIGN(K_SPACE_END);
+	i = minfo.mmap_length / sizeof(addr_range_t);
+	npg = mm_pgtbls.nfree > i ? mm_pgtbls.nfree - i : 0;
+	if ((K_DMAP_END - dmap_end) / PGDIR_SIZE > npg)
+		dmap_end += npg * PGDIR_SIZE;
+	else
+		dmap_end = K_DMAP_END;
+
 	// begin to initialize paging for rest available physical memory
 	// for kernel heap and user spaces
 	va = (void *)PAGE_ALIGN(K_SPACE_END);
 	_va = va;
 	mp = minfo.mmap_entries;
 	for (; (_u32) mp < (_u32) minfo.mmap_entries + minfo.mmap_length; mp++) {
+		if (mp->type != ARDS_TYPE_AVAIL
+		    || split_at_4g(mp, &map_start, &map_end))
+			continue;
+
 		// only use memory after K_SPACE_END 
-		if (mp->type == ARDS_TYPE_AVAIL
-		    && mp->base_addr_low + mp->length_low >= (_u32) va) {
-			if (mp->base_addr_low < (_u32) va)
+		if (map_end >= (_u32) va) {
+			if (map_start < (_u32) va)
 				map_start = (_u32) va;
-			else
-				map_start = mp->base_addr_low;
-			map_end = mp->base_addr_low + mp->length_low;
 
-			// start mapping from K_SPACE_END
-			// first, check if PDE & PTE are present
+			// start mapping from K_SPACE_END, the whole range is
+			// filled table by table without flushing TLB
 			p = (void *)PAGE_ALIGN(map_start);
-			while ((_u32) p < (map_end & PAGE_MASK)) {
-				if (__page_map
-				    (va, p, &pdp[PGD_IDX_KERNEL],
-				     &mm_pgtbls, 0) != OK)
-					PANIC("Page mapping failed");
-				p = (void *)((_u32) p + PAGE_SIZE);
-				va = (void *)((_u32) va + PAGE_SIZE);
+			if ((_u32) p >= (map_end & PAGE_MASK))
+				continue;
+			npg = ((map_end & PAGE_MASK) - (_u32) p) / PAGE_SIZE;
+
+			// frames beyond dmap_end are left for high memory
+			if ((_u32) va >= dmap_end) {
+				add_high_frames((_u32) p, npg);
+				continue;
+			}
+			if ((_u32) va + npg * PAGE_SIZE > dmap_end) {
+				map_start = (dmap_end - (_u32) va) / PAGE_SIZE;
+				add_high_frames((_u32) p + map_start * PAGE_SIZE,
+						npg - map_start);
+				npg = map_start;
 			}
+			if (__page_map_range(va, p, npg, &pdp[PGD_IDX_KERNEL],
+					     &mm_pgtbls, PAGE_KERNEL | page_nx,
+					     0) != OK)
+				PANIC("Page mapping failed");
+
+			// memblock leftovers run into the first range, they
+			// are identity mapped as part of kernel space
+			if (va == _va && p == va && mb_end == (addr_t) va
+			    && mb_start < mb_end)
+				_va = (void *)mb_start;
+			va = (void *)((_u32) va + npg * PAGE_SIZE);
 		}
 	}
 
@@ -286,9 +763,26 @@ void init_paging()
 	if (INIT_MM(&mm_phys, _va, va - _va))
 		PANIC("Physical memory init failed");
 
-	// set address range of high memory
+	// set address range of high memory, it starts from a new page table
+	// so that no page table is shared between kernel and user space
 	log_info("set high memory ...\n");
-	set_high_mem((_u32) mm_phys.base + mm_phys.length, K_HMEM_END);
+	set_high_mem(PGDIR_ALIGN((_u32) mm_phys.base + mm_phys.length),
+		     K_HMEM_END);
+
+	// meta data of high memory frames is in mm_phys
+	init_high_frames();
+	init_pfn_zones();
+
+	// one descriptor for each frame of mm_phys
+	init_mem_map();
+
+	// the frame mapped for reads of untouched memory
+	zero_page = alloc_frame(&mm_phys);
+	if (zero_page == NULL)
+		PANIC("No frame for zero page");
+	bzero(zero_page, PAGE_SIZE);
+
+	register_shrinker(&zpool_shrinker);
 
 	// register page fault handler and enable paging
 	register_interrupt_handler(14, &page_fault_handler);
@@ -298,7 +792,14 @@ void init_paging()
 int page_map(void *virt_addr, void *phys_addr, page_directory_t * pdir,
 	     mmc_t * mp)
 {
-	return __page_map(virt_addr, phys_addr, pdir, mp, 1);
+	return __page_map(virt_addr, phys_addr, pdir, mp,
+			  page_flags_by_addr(virt_addr), 1);
+}
+
+int page_map_pfn(void *virt_addr, _u32 pfn, page_directory_t * pdir)
+{
+	return __page_map_pfn_range(virt_addr, pfn, 1, pdir, NULL,
+				    page_flags_by_addr(virt_addr), 1);
 }
 
 int page_unmap(void *virt_addr, page_directory_t * pdir)
@@ -306,83 +807,1048 @@ int page_unmap(void *virt_addr, page_directory_t * pdir)
 	return __page_unmap(virt_addr, pdir, 1);
 }
 
+int page_map_range(void *virt_addr, void *phys_addr, size_t npg,
+		   page_directory_t * pdir, mmc_t * mp)
+{
+	return __page_map_range(virt_addr, phys_addr, npg, pdir, mp,
+				page_flags_by_addr(virt_addr), 1);
+}
+
+int page_unmap_range(void *virt_addr, size_t npg, page_directory_t * pdir)
+{
+	return __page_unmap_range(virt_addr, npg, pdir, 1);
+}
+
+int page_unmap_user(void *virt_addr, size_t npg, page_directory_t * pdir)
+{
+	page_entry_t *ptep;
+	_u32 va = (_u32) virt_addr & PAGE_MASK;
+	size_t n;
+
+	for (n = 0; n < npg; n++, va += PAGE_SIZE) {
+		ptep = get_page_entry((void *)va, pdir);
+		if (ptep == NULL || !(*ptep & PAGE_PRESENT)
+		    || !is_phys_frame((void *)(_u32) * ptep)
+		    || ((_u32) * ptep & PAGE_MASK) ==
+		    __virt_to_phys(k_pdir, (_u32) zero_page))
+			continue;
+		put_page(phys_to_page((void *)(_u32) * ptep));
+	}
+
+	// swap slots are released with the entries
+	return __page_unmap_range(virt_addr, npg, pdir, 1);
+}
+
 static int __page_map(void *virt_addr, void *phys_addr, page_directory_t * pdir,
-		      mmc_t * mp, int flush)
+		      mmc_t * mp, page_entry_t flags, int flush)
+{
+	return __page_map_range(virt_addr, phys_addr, 1, pdir, mp, flags,
+				flush);
+}
+
+static int __page_unmap(void *virt_addr, page_directory_t * pdir, int flush)
+{
+	return __page_unmap_range(virt_addr, 1, pdir, flush);
+}
+
+// kernel space (direct map and everything above high memory) is shared by
+// all address spaces, the rest belongs to user
+static page_entry_t page_flags_by_addr(void *virt_addr)
+{
+	if (is_user_addr((_u32) virt_addr))
+		return PAGE_USER_RW;
+	// kernel code lives in the identity map only
+	if ((_u32) virt_addr >= K_SPACE_END)
+		return PAGE_KERNEL | page_nx;
+	return PAGE_KERNEL;
+}
+
+static int is_user_addr(_u32 addr)
+{
+	return addr >= get_high_mem_start() && addr < K_HMEM_END;
+}
+
+// return page table covering virt_addr, if the table is not present it is
+// allocated and linked into the directory. Boot-time tables come from mp,
+// otherwise (mp is NULL) tables are taken from mm_phys and count their
+// present entries in nr_ptes of the descriptor, so they can be freed once
+// empty.
+// PDE only carries PAGE_USER when user pages are mapped under it, PTEs
+// decide the actual protection
+static page_table_t *__get_page_table(void *virt_addr, page_directory_t * pdir,
+				      mmc_t * mp, page_entry_t flags)
 {
 	page_table_t *ptp;
-	page_table_t **pdep = &pdir->tables[PDE_INDEX(virt_addr)];
+	page_entry_t *pdep = &pdir->tables[PDE_INDEX(virt_addr)];
+	_u32 pde_flags = PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER);
 
-	if (*pdep == NULL) {
+	if (*pdep != 0) {
+		*pdep |= pde_flags;
+		return (page_table_t *) ((_u32) * pdep & PAGE_MASK);
+	}
+
+	if (mp != NULL) {
 		ptp = (page_table_t *) alloc_frame(mp);
+		if (ptp == NULL)
+			return NULL;
 		bzero(ptp, PAGE_SIZE);
-		*pdep =
-		    (page_table_t *) ((_u32) ptp | PAGE_PRESENT | PAGE_WRITE |
-				      PAGE_USER);
 	} else {
-		ptp = (page_table_t *) ((_u32) * pdep & PAGE_MASK);
+		ptp = (page_table_t *) get_zeroed_page();
+		if (ptp == NULL)
+			return NULL;
+		ptp = (page_table_t *) __virt_to_phys(k_pdir, (_u32) ptp);
+		set_page_owner(phys_to_page(ptp), PGO_PGTABLE);
 	}
+	*pdep = (_u32) ptp | pde_flags;
 
-	ptp->pages[PTE_INDEX(virt_addr)] =
-	    (page_entry_t) ((_u32) phys_addr | PAGE_PRESENT | PAGE_WRITE |
-			    PAGE_USER);
-	if (flush)
-		asm volatile ("invlpg (%0)"::"a" ((_u32) virt_addr));
+	return ptp;
+}
 
-	return 0;
+static page_table_t *__lookup_page_table(void *virt_addr,
+					 page_directory_t * pdir)
+{
+	return (page_table_t *) ((_u32) pdir->tables[PDE_INDEX(virt_addr)] &
+				 PAGE_MASK);
 }
 
-static int __page_unmap(void *virt_addr, page_directory_t * pdir, int flush)
+// account nr entries which were cleared from the table, a user page table
+// with no entries left is unlinked and released. Kernel tables are shared
+// by all page directories and stay forever
+static void __put_page_table(void *virt_addr, page_directory_t * pdir,
+			     page_table_t * ptp, _u32 nr)
+{
+	page_t *page = phys_to_page(ptp);
+
+	if (page == NULL)
+		return;
+	ASSERT(page->nr_ptes >= nr);
+	page->nr_ptes -= nr;
+
+	if (page->nr_ptes == 0 && is_user_addr((_u32) virt_addr)) {
+		pdir->tables[PDE_INDEX(virt_addr)] = 0;
+		put_page(page);
+	}
+}
+
+// map npg pages from virt_addr to phys_addr, PDE is looked up only once for
+// each page table and PTEs inside the table are filled in a tight loop
+static int __page_map_range(void *virt_addr, void *phys_addr, size_t npg,
+			    page_directory_t * pdir, mmc_t * mp,
+			    page_entry_t flags, int flush)
+{
+	return __page_map_pfn_range(virt_addr, (_u32) phys_addr >> 12, npg,
+				    pdir, mp, flags, flush);
+}
+
+// entries are built from frame numbers, PAE frames above 4GB have no 32-bit
+// physical address
+static int __page_map_pfn_range(void *virt_addr, _u32 pfn, size_t npg,
+				page_directory_t * pdir, mmc_t * mp,
+				page_entry_t flags, int flush)
 {
 	page_table_t *ptp;
+	_u32 va = (_u32) virt_addr & PAGE_MASK;
+	_u32 idx, n, added;
+	size_t left = npg;
 
-	ptp = pdir->tables[PDE_INDEX(virt_addr)];
-	ptp = (page_table_t *) ((_u32) ptp & PAGE_MASK);
-	ptp->pages[PTE_INDEX(virt_addr)] = (page_entry_t) NULL;
+	while (left > 0) {
+		ptp = __get_page_table((void *)va, pdir, mp, flags);
+		if (ptp == NULL)
+			return 1;
+
+		idx = PTE_INDEX(va);
+		n = PTE_NUM_P_TBL - idx;
+		if (n > left)
+			n = left;
+		left -= n;
+		va += n * PAGE_SIZE;
+
+		for (added = 0; n > 0; n--, idx++, pfn++) {
+			if (ptp->pages[idx] == 0)
+				added++;
+			else if (IS_SWAP_PTE(ptp->pages[idx]))
+				swap_free(SWP_SLOT(ptp->pages[idx]));
+			ptp->pages[idx] = ((page_entry_t) pfn << 12) | flags;
+		}
+		if (is_phys_frame(ptp))
+			phys_to_page(ptp)->nr_ptes += added;
+	}
 
 	if (flush)
-		asm volatile ("invlpg (%0)"::"a" ((_u32) virt_addr));
+		flush_tlb_range(virt_addr, npg);
 
-	return 0;
+	return OK;
+}
+
+static int __page_unmap_range(void *virt_addr, size_t npg,
+			      page_directory_t * pdir, int flush)
+{
+	page_table_t *ptp;
+	_u32 va = (_u32) virt_addr & PAGE_MASK;
+	_u32 idx, n, removed;
+	size_t left = npg;
+
+	while (left > 0) {
+		ptp = __lookup_page_table((void *)va, pdir);
+
+		idx = PTE_INDEX(va);
+		n = PTE_NUM_P_TBL - idx;
+		if (n > left)
+			n = left;
+		left -= n;
+
+		// nothing mapped under this PDE
+		if (ptp == NULL) {
+			va += n * PAGE_SIZE;
+			continue;
+		}
+		for (removed = 0; n > 0; n--, idx++, va += PAGE_SIZE) {
+			if (ptp->pages[idx] != 0)
+				removed++;
+			if (IS_SWAP_PTE(ptp->pages[idx]))
+				swap_free(SWP_SLOT(ptp->pages[idx]));
+			ptp->pages[idx] = 0;
+		}
+		__put_page_table((void *)(va - PAGE_SIZE), pdir, ptp, removed);
+	}
+
+	if (flush)
+		flush_tlb_range(virt_addr, npg);
+
+	return OK;
+}
+
+// invalidating pages one by one only pays off for small ranges, for larger
+// ones flush the whole TLB and let it refill on demand
+void flush_tlb_range(void *virt_addr, size_t npg)
+{
+	_u32 va = (_u32) virt_addr & PAGE_MASK;
+
+	if (npg > TLB_FLUSH_MAX_PAGES) {
+		flush_tlb_all();
+		return;
+	}
+
+	for (; npg > 0; npg--, va += PAGE_SIZE)
+		asm volatile ("invlpg (%0)"::"r" (va):"memory");
 }
 
 static void page_fault_handler(registers_t * regs)
 {
-	_u32 cr2, phys;
+	_u32 cr2;
 	char msg[64];
-	void *freep;
 
 	asm volatile ("mov %%cr2, %0":"=r" (cr2));
 	sprintf(msg, "*** PAGE FAULT @0x%08X, e=0x%08X", cr2, regs->err_code);
 	log_dbg("\n%s\n", msg);
 
+	// kernel page table created after current page directory was set up
+	if (!(regs->err_code & PF_PRESENT)
+	    && sync_kernel_pde(get_curr_page_directory(), cr2) == OK)
+		return;
+
+	// swap in waits on the device and reclaim shoots down TLBs of other
+	// processors, take interrupts if the faulting context did
+	if (regs->eflags & EFLAGS_IF)
+		local_irq_enable();
+	do_page_fault(regs, cr2);
+	local_irq_disable();
+}
+
+static void do_page_fault(registers_t * regs, _u32 cr2)
+{
+	// user addresses are only valid inside an area of current task
+	if (is_user_addr(cr2)) {
+		if (do_user_fault(get_curr_page_directory(), cr2,
+				  regs->err_code) == OK)
+			return;
+		PANIC("Access out of user areas");
+	}
+
+	// write to a copy-on-write page of current address space
+	if ((regs->err_code & PF_PRESENT) && (regs->err_code & PF_WRITE)) {
+		if (do_cow_fault(get_curr_page_directory(), cr2) == OK)
+			return;
+		PANIC("Write to read-only page");
+	}
+
+	// vmalloc areas are fully mapped, this is a guard page or a freed area
+	if (is_vmalloc_addr(cr2))
+		PANIC("Access to unmapped vmalloc area");
+
 	ASSERT(cr2 < get_high_mem_start() || cr2 >= 0xfee00000);
 
 	// this is for LAPIC and IO-APIC mapping under x86 paging
 	if (cr2 >= 0xfee00000) {
-		page_map((void *)cr2, (void *)cr2, k_pdir, &mm_pgtbls);
+		page_map((void *)cr2, (void *)cr2, k_pdir, NULL);
 		return;
 	}
+	// swapped out page
+	if (do_swap_fault(k_pdir, cr2) == OK)
+		return;
+
 	// alloc free pages for mmp_high meta
 	// if (is_kernel && state_hm_init){
-	freep = get_free_page();
-
-	if (!freep)		// && errno == ERR_MM_FULL
+	if (do_demand_fault(k_pdir, cr2, regs->err_code & PF_WRITE,
+			    page_flags_by_addr((void *)cr2), 0,
+			    get_high_mem_start()) != OK)
 		PANIC("No more phisical memory pages");
-	phys = __virt_to_phys(k_pdir, (_u32) freep);
-	page_map((void *)cr2, (void *)phys, k_pdir, &mm_pgtbls);
 	// }
 }
 
-void switch_page_directory(page_directory_t * dir)
+// permissions come from the area, the lookup is a walk down the VMA tree
+static int do_user_fault(page_directory_t * pdir, _u32 addr, _u32 err)
+{
+	task_t *task = get_curr_task();
+	vma_t vma;
+	page_entry_t flags;
+
+	if (task == NULL || lookup_vma(&task->vm, addr, &vma))
+		return 1;
+
+	if ((err & PF_WRITE) && !(vma.flags & VM_WRITE))
+		return 1;
+	if (err & PF_PRESENT)
+		return (err & PF_WRITE) ? do_cow_fault(pdir, addr) : 1;
+	if (do_swap_fault(pdir, addr) == OK)
+		return OK;
+
+	flags = PAGE_PRESENT | PAGE_USER;
+	if (vma.flags & VM_WRITE)
+		flags |= PAGE_WRITE;
+	if (!(vma.flags & VM_EXEC))
+		flags |= page_nx;
+	return do_demand_fault(pdir, addr, err & PF_WRITE, flags, vma.start,
+			       vma.end);
+}
+
+// map fresh frames for the aligned window of FAULT_AROUND_PAGES pages around
+// the faulting address, clipped to [lo, hi). Pages already present are
+// skipped. Only the faulting page is mandatory, the window shrinks when
+// frames run out. Read faults map the shared zero page instead and consume
+// no frames at all. Entries are installed with cmpxchg, a racing fault on
+// the same page keeps its own
+static int do_demand_fault(page_directory_t * pdir, _u32 addr, int write,
+			   page_entry_t flags, _u32 lo, _u32 hi)
+{
+	page_table_t *ptp;
+	page_entry_t *ptep;
+	_u32 start, end, va;
+	void *freep;
+	page_entry_t zero_pte;
+	int zero = (flags & PAGE_USER) != 0;
+
+	start = addr & ~(FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+	end = start + FAULT_AROUND_PAGES * PAGE_SIZE;
+	if (start < lo)
+		start = lo;
+	if (end > hi || end < start)
+		end = hi;
+
+	ptp = __get_page_table((void *)addr, pdir, NULL, flags);
+	if (ptp == NULL)
+		return 1;
+
+	zero_pte = (page_entry_t) (__virt_to_phys(k_pdir, (_u32) zero_page) |
+				   (flags & ~PAGE_WRITE) | PAGE_COW);
+	for (va = start; va < end; va += PAGE_SIZE) {
+		ptep = &ptp->pages[PTE_INDEX(va)];
+		// present or swapped out
+		if (*ptep != 0)
+			continue;
+		if (!write) {
+			if (pte_cmpxchg(ptep, 0, zero_pte) == 0
+			    && is_phys_frame(ptp))
+				atomic_inc16(&phys_to_page(ptp)->nr_ptes);
+			continue;
+		}
+
+		// only the faulting page is worth reclaiming for, user pages
+		// must not show what the frame held before
+		if ((va & PAGE_MASK) == (addr & PAGE_MASK))
+			freep = alloc_user_page(zero);
+		else
+			freep = zero ? get_zeroed_page() : get_free_page();
+		if (freep == NULL) {
+			if ((va & PAGE_MASK) == (addr & PAGE_MASK))
+				return 1;
+			continue;
+		}
+		freep = (void *)__virt_to_phys(k_pdir, (_u32) freep);
+		if (pte_cmpxchg(ptep, 0, (page_entry_t) ((_u32) freep | flags))
+		    != 0) {
+			// another processor faulted the page in meanwhile
+			put_page(phys_to_page(freep));
+			continue;
+		}
+		// kernel pages are never reclaimed, they stay off the LRU
+		if (flags & PAGE_USER)
+			set_anon_rmap(phys_to_page(freep), pdir, va);
+		if (is_phys_frame(ptp))
+			atomic_inc16(&phys_to_page(ptp)->nr_ptes);
+	}
+
+	// entries were not present before, so none of them can be cached in
+	// TLB and no flush is needed
+	return OK;
+}
+
+static int is_phys_frame(void *phys)
 {
-	_u32 cr0;
+	_u32 va = __phys_to_virt_lm(NULL, (_u32) phys & PAGE_MASK);
+
+	return va >= (_u32) mm_phys.frame_base
+	    && (va - (_u32) mm_phys.frame_base) / PAGE_SIZE < mm_phys.nframes;
+}
 
+// descriptor of a frame in mm_phys, NULL for frames out of mm_phys
+page_t *phys_to_page(void *phys)
+{
+	_u32 va = __phys_to_virt_lm(NULL, (_u32) phys & PAGE_MASK);
+
+	if (mem_map == NULL || !is_phys_frame(phys))
+		return NULL;
+	return &mem_map[(va - (_u32) mm_phys.frame_base) / PAGE_SIZE];
+}
+
+void *page_to_phys(page_t * page)
+{
+	return (void *)__virt_to_phys(k_pdir, (_u32) mm_phys.frame_base +
+				      (page - mem_map) * PAGE_SIZE);
+}
+
+void set_page_owner(page_t * page, _u8 owner)
+{
+	ASSERT(page->count > 0 && owner < PGO_MAX);
+	nr_owned[page->owner]--;
+	nr_owned[owner]++;
+	page->owner = owner;
+}
+
+size_t nr_pages_owned(_u8 owner)
+{
+	return owner < PGO_MAX ? nr_owned[owner] : 0;
+}
+
+void get_page(page_t * page)
+{
+	ASSERT(page->count > 0);
+	atomic_inc16(&page->count);
+}
+
+void put_page(page_t * page)
+{
+	ASSERT(page->count > 0);
+	if (!atomic_dec_and_test16(&page->count))
+		return;
+	if (page->flags & PG_LRU)
+		lru_del_page(page);
+	if (page->swap) {
+		swap_free(page->swap);
+		page->swap = 0;
+	}
+	free_frames(&mm_phys, (void *)__phys_to_virt_lm(NULL, (_u32)
+								page_to_phys
+								(page)));
+}
+
+void show_mem()
+{
+	printk("frames: %d, free: %d, kernel: %d, user: %d, "
+	       "page tables: %d, cache: %d, slab: %d\n", mm_phys.nframes,
+	       nr_owned[PGO_FREE], nr_owned[PGO_KERNEL], nr_owned[PGO_ANON],
+	       nr_owned[PGO_PGTABLE], nr_owned[PGO_CACHE], nr_owned[PGO_SLAB]);
+#if HEAP_PROFILE
+	show_kmalloc_sites(8, 3600);
+#endif
+}
+
+// user pages mapped only once can be copied elsewhere and remapped
+static int is_movable(page_t * page)
+{
+	return page->owner == PGO_ANON && page->count == 1;
+}
+
+void get_frag_info(frag_info_t * info)
+{
+	_u32 n, run = 0;
+
+	bzero(info, sizeof(frag_info_t));
+	info->nfree = mm_phys.nfree;
+	for (n = 0; n < mm_phys.nframes; n++) {
+		if (PGCOLOR(mm_phys.meta_base[n]) == PG_WHITE) {
+			if (run++ == 0)
+				info->free_runs++;
+			if (run > info->largest_run)
+				info->largest_run = run;
+			continue;
+		}
+		run = 0;
+		if (mem_map && is_movable(&mem_map[n]))
+			info->movable++;
+	}
+}
+
+void show_frag_info()
+{
+	frag_info_t info;
+
+	get_frag_info(&info);
+	printk("free: %d, free runs: %d, largest run: %d, movable: %d\n",
+	       info.nfree, info.free_runs, info.largest_run, info.movable);
+}
+
+// make room for npg contiguous frames by moving user pages out of the
+// window which needs fewest migrations. Pages are found by walking page
+// tables of all address spaces. Migration shoots down TLBs of other
+// processors, so callers with interrupts off (atomic) do not compact
+int compact_frames(size_t npg)
+{
+	compact_ctl_t cc;
+	_u32 nmov;
+
+	if (!(local_get_flags() & EFLAGS_IF))
+		return 1;
+	if (mem_map == NULL || find_compact_window(npg, &cc.first, &nmov))
+		return 1;
+	// frames outside the window have to take the migrated pages
+	if (mm_phys.nfree - (npg - nmov) < nmov)
+		return 1;
+
+	// a page being moved must not be unmapped meanwhile. vm_map may get
+	// here from kmalloc with the lock held, so never wait for it
+	if (!vma_trylock())
+		return 1;
+	cc.last = cc.first + npg;
+	cc.left = nmov;
+	compact_addr_space(k_pdir, &cc);
+	for_each_addr_space(compact_addr_space, &cc);
+	vma_unlock();
+
+	log_info(LOG_MM "compaction for %d frame(s), %d of %d migrated\n",
+		 npg, nmov - cc.left, nmov);
+	return cc.left == 0 ? OK : 1;
+}
+
+// sliding window over frames, only free and movable frames are allowed
+static int find_compact_window(_u32 npg, _u32 * first, _u32 * nmov)
+{
+	_u32 n, pinned = 0, movable = 0, best = npg + 1;
+	page_t *page;
+
+	if (npg > mm_phys.nframes)
+		return 1;
+
+	for (n = 0; n < mm_phys.nframes; n++) {
+		page = &mem_map[n];
+		if (page->count > 0) {
+			if (is_movable(page))
+				movable++;
+			else
+				pinned++;
+		}
+
+		if (n >= npg) {
+			page = &mem_map[n - npg];
+			if (page->count > 0) {
+				if (is_movable(page))
+					movable--;
+				else
+					pinned--;
+			}
+		}
+
+		if (n + 1 >= npg && pinned == 0 && movable < best) {
+			best = movable;
+			*first = n + 1 - npg;
+		}
+	}
+
+	if (best > npg)
+		return 1;
+	*nmov = best;
+	return OK;
+}
+
+static void compact_addr_space(page_directory_t * pdir, void *arg)
+{
+	compact_ctl_t *cc = (compact_ctl_t *) arg;
+	page_table_t *ptp;
+	page_entry_t *ptep;
+	page_t *page;
+	_u32 pde, idx, n;
+
+	for (pde = PDE_INDEX(get_high_mem_start());
+	     pde < PDE_INDEX(K_HMEM_END) && cc->left > 0; pde++) {
+		ptp = __lookup_page_table((void *)PDE_ADDR(pde), pdir);
+		if (ptp == NULL)
+			continue;
+
+		for (idx = 0; idx < PTE_NUM_P_TBL; idx++) {
+			ptep = &ptp->pages[idx];
+			if (!(*ptep & PAGE_PRESENT))
+				continue;
+			page = phys_to_page((void *)(_u32) * ptep);
+			if (page == NULL || !is_movable(page))
+				continue;
+			n = page - mem_map;
+			if (n < cc->first || n >= cc->last)
+				continue;
+			if (migrate_page(pdir, PDE_ADDR(pde) + idx * PAGE_SIZE,
+					 ptep, cc) == OK)
+				cc->left--;
+		}
+	}
+}
+
+// the entry is write protected while the frame is copied, a write in between
+// takes the COW fault path and the migration of this page is given up
+static int migrate_page(page_directory_t * pdir, _u32 va,
+			page_entry_t * ptep, compact_ctl_t * cc)
+{
+	page_entry_t old, ro, cur, new;
+	void *newp;
+
+	newp = alloc_frame_outside(&mm_phys, cc->first, cc->last);
+	if (newp == NULL)
+		return 1;
+
+	old = *ptep;
+	ro = (old & PAGE_WRITE) ? ((old & ~PAGE_WRITE) | PAGE_COW) : old;
+	if (pte_cmpxchg(ptep, old, ro) != old)
+		goto abort;
+	flush_tlb_all();
+	smp_flush_tlb_others();
+	// fork or reclaim took a reference after the page was picked, the
+	// entry stays write protected and COW fault sorts it out
+	if (phys_to_page((void *)(_u32) old)->count != 1)
+		goto abort;
+
+	memcpy(newp, (void *)__phys_to_virt_lm(NULL, (_u32) old & PAGE_MASK),
+	       PAGE_SIZE);
+
+	cur = *ptep;
+	if ((cur & ~PAGE_ACCESSED) != (ro & ~PAGE_ACCESSED))
+		goto abort;
+	new = __virt_to_phys(k_pdir, (_u32) newp) | (old & PTE_FLAGS_MASK) |
+	    (cur & PAGE_ACCESSED);
+	if (pte_cmpxchg(ptep, cur, new) != cur)
+		goto abort;
+	flush_tlb_all();
+	smp_flush_tlb_others();
+
+	// the copy in swap still matches, it goes with the contents
+	phys_to_page((void *)(_u32) new)->swap =
+	    phys_to_page((void *)(_u32) old)->swap;
+	phys_to_page((void *)(_u32) old)->swap = 0;
+	set_anon_rmap(phys_to_page((void *)(_u32) new), pdir, va);
+	put_page(phys_to_page((void *)(_u32) old));
+	return OK;
+
+      abort:
+	free_frames(&mm_phys, newp);
+	return 1;
+}
+
+// descriptors are taken from mm_phys, frames allocated so far are all
+// accounted to kernel
+static void init_mem_map()
+{
+	page_t *mm;
+	_u32 npg, n;
+
+	npg = PAGE_CONTAIN(mm_phys.nframes * sizeof(page_t));
+	mm = (page_t *) alloc_frames(&mm_phys, npg);
+	if (mm == NULL)
+		PANIC("No frames for frame descriptors");
+	bzero(mm, npg * PAGE_SIZE);
+
+	for (n = 0; n < mm_phys.nframes; n++) {
+		INIT_LIST_HEAD(&mm[n].lru);
+		if (PGCOLOR(mm_phys.meta_base[n]) != PG_WHITE) {
+			mm[n].count = 1;
+			mm[n].owner = PGO_KERNEL;
+		}
+	}
+	nr_owned[PGO_FREE] = mm_phys.nfree;
+	nr_owned[PGO_KERNEL] = mm_phys.nframes - mm_phys.nfree;
+	mem_map = mm;
+}
+
+static void mem_map_alloc(_u32 idx, _u32 npg)
+{
+	page_t *page;
+
+	for (page = &mem_map[idx]; page < &mem_map[idx + npg]; page++) {
+		page->count = 1;
+		page->flags = 0;
+		page->owner = PGO_KERNEL;
+	}
+	nr_owned[PGO_FREE] -= npg;
+	nr_owned[PGO_KERNEL] += npg;
+}
+
+static void mem_map_free(_u32 idx, _u32 npg)
+{
+	page_t *page;
+
+	for (page = &mem_map[idx]; page < &mem_map[idx + npg]; page++) {
+		ASSERT(list_empty(&page->lru));
+		nr_owned[page->owner]--;
+		page->count = 0;
+		page->flags = 0;
+		page->owner = PGO_FREE;
+		page->nr_ptes = 0;
+		page->mapping = NULL;
+	}
+	nr_owned[PGO_FREE] += npg;
+}
+
+// read a swapped out page back into a new frame. The page keeps the
+// reference of the entry to its slot, while it is not written the copy in
+// swap stays valid and the page can be reclaimed again without IO
+static int do_swap_fault(page_directory_t * pdir, _u32 addr)
+{
+	page_entry_t *ptep, pte;
+	void *newp;
+
+	ptep = get_page_entry((void *)addr, pdir);
+	if (ptep == NULL || !IS_SWAP_PTE(*ptep))
+		return 1;
+	pte = *ptep;
+
+	// the read waits on the device
+	if (!(local_get_flags() & EFLAGS_IF))
+		PANIC("Swap in with interrupts off");
+
+	newp = alloc_user_page(0);
+	if (newp == NULL)
+		PANIC("No more phisical memory pages");
+	if (swap_read_page(SWP_SLOT(pte), newp) != OK)
+		PANIC("Swap in failed");
+
+	newp = (void *)__virt_to_phys(k_pdir, (_u32) newp);
+	if (pte_cmpxchg(ptep, pte, (_u32) newp | SWP_FLAGS(pte) |
+			PAGE_PRESENT) != pte) {
+		// swapped in by someone else meanwhile
+		put_page(phys_to_page(newp));
+		return OK;
+	}
+	phys_to_page(newp)->swap = SWP_SLOT(pte);
+	set_anon_rmap(phys_to_page(newp), pdir, addr);
+
+	return OK;
+}
+
+// frame for a user page, reclaim some pages if none is free
+static void *alloc_user_page(int zero)
+{
+	void *p;
+
+	p = zero ? get_zeroed_page() : get_free_page();
+	if (p == NULL && try_to_free_pages(SWAP_CLUSTER) > 0)
+		p = zero ? get_zeroed_page() : get_free_page();
+	return p;
+}
+
+// anonymous page mapped once at va of pdir, it can be reclaimed through
+// this mapping
+static void set_anon_rmap(page_t * page, page_directory_t * pdir, _u32 va)
+{
+	set_page_owner(page, PGO_ANON);
+	page->mapping = pdir;
+	page->index = va & PAGE_MASK;
+	lru_add_page(page);
+}
+
+// the first write to a shared page gets its own copy, the last sharer
+// simply takes the frame back as writable
+static int do_cow_fault(page_directory_t * pdir, _u32 addr)
+{
+	page_table_t *ptp;
+	page_entry_t *ptep;
+	page_t *page;
+	void *newp, *oldp;
+
+	ptp = __lookup_page_table((void *)addr, pdir);
+	if (ptp == NULL)
+		return 1;
+	ptep = &ptp->pages[PTE_INDEX(addr)];
+	if (!(*ptep & PAGE_COW))
+		return 1;
+
+	oldp = (void *)((_u32) * ptep & PAGE_MASK);
+
+	// first write to untouched memory, nothing to copy
+	if (oldp == (void *)__virt_to_phys(k_pdir, (_u32) zero_page)) {
+		newp = alloc_user_page(1);
+		if (newp == NULL)
+			PANIC("No more phisical memory pages");
+		newp = (void *)__virt_to_phys(k_pdir, (_u32) newp);
+		if (*ptep & PAGE_USER)
+			set_anon_rmap(phys_to_page(newp), pdir, addr);
+		*ptep = (page_entry_t) ((_u32) newp | (*ptep & PTE_FLAGS_MASK) |
+					PAGE_WRITE) & ~PAGE_COW;
+		flush_tlb_range((void *)addr, 1);
+		return OK;
+	}
+
+	page = phys_to_page(oldp);
+	if (page == NULL || page->count <= 1) {
+		*ptep = (*ptep | PAGE_WRITE) & ~PAGE_COW;
+		// the last sharer, it may not be the one recorded
+		if (page != NULL) {
+			page->mapping = pdir;
+			page->index = addr & PAGE_MASK;
+		}
+	} else {
+		newp = alloc_user_page(0);
+		if (newp == NULL)
+			PANIC("No more phisical memory pages");
+		memcpy(newp, (void *)__phys_to_virt_lm(pdir, (_u32) oldp),
+		       PAGE_SIZE);
+		put_page(page);
+
+		newp = (void *)__virt_to_phys(k_pdir, (_u32) newp);
+		if (*ptep & PAGE_USER)
+			set_anon_rmap(phys_to_page(newp), pdir, addr);
+		*ptep = (page_entry_t) ((_u32) newp | (*ptep & PTE_FLAGS_MASK) |
+					PAGE_WRITE) & ~PAGE_COW;
+	}
+	flush_tlb_range((void *)addr, 1);
+
+	return OK;
+}
+
+// duplicate user mappings from src into dst, both of them are write
+// protected and share the frames until either side writes. dst is supposed
+// to be a copy of the kernel page directory
+int copy_address_space(page_directory_t * src, page_directory_t * dst)
+{
+	page_table_t *sptp, *dptp;
+	page_entry_t *sp, *dp;
+	_u32 va, pde, idx, nr;
+	page_t *page;
+
+	for (pde = PDE_INDEX(get_high_mem_start()); pde < PDE_INDEX(K_HMEM_END);
+	     pde++) {
+		dst->tables[pde] = 0;
+		if (src->tables[pde] == 0)
+			continue;
+		sptp = (page_table_t *) ((_u32) src->tables[pde] & PAGE_MASK);
+		va = PDE_ADDR(pde);
+
+		dptp = __get_page_table((void *)va, dst, NULL,
+					(_u32) src->tables[pde] & PAGE_USER);
+		if (dptp == NULL)
+			return 1;
+
+		for (idx = 0, nr = 0; idx < PTE_NUM_P_TBL; idx++, va += PAGE_SIZE) {
+			if (sptp->pages[idx] != 0)
+				nr++;
+
+			sp = &sptp->pages[idx];
+			dp = &dptp->pages[idx];
+
+			// both sides refer to the same swap slot
+			if (IS_SWAP_PTE(*sp)) {
+				swap_dup(SWP_SLOT(*sp));
+				*dp = *sp;
+				continue;
+			}
+
+			if (!(*sp & PAGE_PRESENT) || !(*sp & PAGE_USER)) {
+				*dp = *sp;
+				continue;
+			}
+			if (*sp & (PAGE_WRITE | PAGE_COW))
+				*sp = (*sp & ~PAGE_WRITE) | PAGE_COW;
+			*dp = *sp;
+
+			// zero page is shared by everyone and never counted
+			if ((*sp & PTE_ADDR_MASK) ==
+			    __virt_to_phys(k_pdir, (_u32) zero_page))
+				continue;
+			page = phys_to_page((void *)((_u32) * sp & PAGE_MASK));
+			if (page != NULL)
+				get_page(page);
+		}
+		if (is_phys_frame(dptp))
+			phys_to_page(dptp)->nr_ptes = nr;
+	}
+	// src may be loaded on other processors with writable entries cached
+	flush_tlb_all();
+	smp_flush_tlb_others();
+
+	return OK;
+}
+
+// allocate a page directory for a new address space, kernel space is shared
+// with k_pdir and user space starts empty
+page_directory_t *alloc_page_directory()
+{
+	page_directory_t *pdir;
+	_u32 pde;
+
+	pdir = (page_directory_t *) get_free_pages(PGD_PAGES);
+	if (pdir == NULL)
+		return NULL;
+	bzero(pdir, sizeof(page_directory_t));
+	init_pdpt(pdir);
+
+	for (pde = 0; pde < PDE_NUM; pde++)
+		if (!is_user_addr(PDE_ADDR(pde)))
+			pdir->tables[pde] = k_pdir->tables[pde];
+
+	return pdir;
+}
+
+// release user page tables and frames only mapped by this directory
+void free_page_directory(page_directory_t * pdir)
+{
+	page_table_t *ptp;
+	page_entry_t pte;
+	_u32 pde, idx;
+
+	ASSERT(pdir != k_pdir);
+	for (pde = PDE_INDEX(get_high_mem_start()); pde < PDE_INDEX(K_HMEM_END);
+	     pde++) {
+		ptp = __lookup_page_table((void *)PDE_ADDR(pde), pdir);
+		if (ptp == NULL)
+			continue;
+
+		for (idx = 0; idx < PTE_NUM_P_TBL; idx++) {
+			pte = ptp->pages[idx];
+			if (IS_SWAP_PTE(pte))
+				swap_free(SWP_SLOT(pte));
+			if (!(pte & PAGE_PRESENT)
+			    || !is_phys_frame((void *)(_u32) pte)
+			    || (pte & PTE_ADDR_MASK) ==
+			    __virt_to_phys(k_pdir, (_u32) zero_page))
+				continue;
+
+			put_page(phys_to_page((void *)(_u32) pte));
+		}
+
+		pdir->tables[pde] = 0;
+		if (is_phys_frame(ptp))
+			put_page(phys_to_page(ptp));
+	}
+
+	free_frames(&mm_phys, pdir);
+}
+
+// kernel page tables are linked into k_pdir on demand, copy the PDE into
+// other page directories the first time they touch that range
+static int sync_kernel_pde(page_directory_t * pdir, _u32 addr)
+{
+	_u32 pde = PDE_INDEX(addr);
+
+	if (pdir == k_pdir || is_user_addr(addr))
+		return 1;
+	if (pdir->tables[pde] != 0 || k_pdir->tables[pde] == 0)
+		return 1;
+
+	pdir->tables[pde] = k_pdir->tables[pde];
+	return OK;
+}
+
+// return page entry of virt_addr, NULL if no page table covers it
+page_entry_t *get_page_entry(void *virt_addr, page_directory_t * pdir)
+{
+	page_table_t *ptp = __lookup_page_table(virt_addr, pdir);
+
+	if (ptp == NULL)
+		return NULL;
+	return &ptp->pages[PTE_INDEX(virt_addr)];
+}
+
+// page directory loaded in CR3 of current processor
+page_directory_t *get_curr_page_directory()
+{
+	_u32 cr3;
+
+	asm volatile ("mov %%cr3, %0":"=r" (cr3));
+#if PAGING_MODE == PAGING_PAE
+	return (page_directory_t *) __phys_to_virt_lm(NULL, (cr3 & ~0x1F) -
+						      PGD_PDPT_OFFSET);
+#else
+	return (page_directory_t *) __phys_to_virt_lm(NULL, cr3 & PAGE_MASK);
+#endif
+}
+
+// PAE page directory pointer table points to the 4 pages of tables, the
+// entries are fetched on CR3 loads
+static void init_pdpt(page_directory_t * pdir)
+{
+#if PAGING_MODE == PAGING_PAE
+	_u32 n;
+
+	for (n = 0; n < 4; n++)
+		pdir->pdpt[n] = (_u32) & pdir->tables[n * PTE_NUM_P_TBL] |
+		    PAGE_PRESENT;
+#endif
+}
+
+// reloading CR3 keeps global entries, toggling CR4.PGE drops them as well
+void flush_tlb_all()
+{
+	_u32 cr3, cr4;
+
+	if (pge_enabled) {
+		asm volatile ("mov %%cr4, %0":"=r" (cr4));
+		asm volatile ("mov %0, %%cr4"::"r" (cr4 & ~CR4_PGE):"memory");
+		asm volatile ("mov %0, %%cr4"::"r" (cr4):"memory");
+		return;
+	}
+
+	asm volatile ("mov %%cr3, %0":"=r" (cr3));
+	asm volatile ("mov %0, %%cr3"::"r" (cr3):"memory");
+}
+
+void switch_page_directory(page_directory_t * dir)
+{
+	_u32 cr0, cr4;
+
+#if PAGING_MODE == PAGING_PAE
+	// PAE and NX must be on before paging uses 64-bit entries
+	asm volatile ("mov %%cr4, %0":"=r" (cr4));
+	cr4 |= CR4_PAE;
+	asm volatile ("mov %0, %%cr4"::"r" (cr4));
+	if (page_nx)
+		wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+	asm volatile ("mov %0, %%cr3"::"r" (&dir->pdpt));
+#else
 	asm volatile ("mov %0, %%cr3"::"r" (&dir->tables));
+#endif
 
-	// enable paging
+	// enable paging, WP makes read-only pages also read-only for kernel
+	// mode so that COW and zero pages work for kernel writes
 	asm volatile ("mov %%cr0, %0":"=r" (cr0));
-	cr0 |= 0x80000000;
+	cr0 |= CR0_PG | CR0_WP;
 	asm volatile ("mov %0, %%cr0"::"r" (cr0));
+
+	// enable global pages so kernel TLB entries survive CR3 reloads,
+	// this is done on every processor which switches on paging
+	if (cpu_has_feature_edx(CPUID_FEAT_EDX_PGE)) {
+		asm volatile ("mov %%cr4, %0":"=r" (cr4));
+		cr4 |= CR4_PGE;
+		asm volatile ("mov %0, %%cr4"::"r" (cr4));
+		pge_enabled = 1;
+	}
+}
+
+// switch to the address space of another task, kernel space is the same in
+// every directory so only CR3 changes
+void load_page_directory(page_directory_t * dir)
+{
+	if (dir == get_curr_page_directory())
+		return;
+#if PAGING_MODE == PAGING_PAE
+	asm volatile ("mov %0, %%cr3"::"r" (&dir->pdpt):"memory");
+#else
+	asm volatile ("mov %0, %%cr3"::"r" (&dir->tables):"memory");
+#endif
 }
 
 // copy pg dir from src to dst, notice that both src and dst will be
@@ -435,6 +1901,7 @@ int MM_PAGE_TABLE(mmc_t * mmcp, void *base, _u32 length)
 	mmcp->frame_base = basep;
 	mmcp->nframes = npg;
 	mmcp->nfree = npg;
+	init_rlock(&mmcp->lock);
 
 	// initialize page table with PG_WHITE entry and address of
 	// free frames accordingly 
@@ -455,10 +1922,62 @@ int MM_PAGE_TABLE(mmc_t * mmcp, void *base, _u32 length)
 	return 0;
 }
 
+// same as MM_PAGE_TABLE but meta data is kept at meta instead of the head of
+// managed area, used for frames which are not accessible from kernel space
+int MM_PAGE_TABLE_OFFPAGE(mmc_t * mmcp, _u32 * meta, void *frame_base,
+			  _u32 npg)
+{
+	_u32 n, mpg;
+	void *basep = (void *)PAGE_ALIGN((_u32) frame_base);
+
+	if (npg < 1)
+		return 1;
+	mpg = PAGE_CONTAIN(npg * META_ENT_SIZE);
+
+	mmcp->base = basep;
+	mmcp->length = npg * PAGE_SIZE;
+	mmcp->meta_base = meta;
+	mmcp->mframes = mpg;
+	mmcp->meta_len = npg * META_ENT_SIZE;
+	mmcp->frame_base = basep;
+	mmcp->nframes = npg;
+	mmcp->nfree = npg;
+	init_rlock(&mmcp->lock);
+
+	log_info("table @ 0x%08X, off-page memory @ 0x%08X\n", (_u32) meta,
+		 (_u32) basep);
+	log_info("%d frame(s), memory size %d KB\n", npg,
+		 PAGE_SIZE * npg / 1024);
+	for (n = 0; n < npg; n++)
+		meta[n] = ((_u32) basep + n * PAGE_SIZE) | PG_WHITE;
+	bzero(&meta[npg], mpg * PAGE_SIZE - npg * META_ENT_SIZE);
+
+	return 0;
+}
+
 void copy_mm_from(mmc_t * mmcp, void *src, void *dst)
 {
 }
 
+// frames are taken from interrupt context too, so the lock is held with
+// interrupts off
+static inline uint_t mmc_lock(mmc_t * mmcp)
+{
+	uint_t flags;
+
+	flags = local_get_flags();
+	local_irq_disable();
+	lock_rlock(&mmcp->lock);
+
+	return flags;
+}
+
+static inline void mmc_unlock(mmc_t * mmcp, uint_t flags)
+{
+	release_rlock(&mmcp->lock);
+	local_set_flags(flags);
+}
+
 static _u32 *find_seq_pages(mmc_t * mmcp, _u32 npages)
 {
 	_u32 *cp = mmcp->meta_base;
@@ -482,26 +2001,60 @@ static _u32 *find_seq_pages(mmc_t * mmcp, _u32 npages)
 	return (_u32 *) NULL;
 }
 
+static void *__mark_frames(mmc_t * mmcp, _u32 * tp, _u32 npages);
+
 static _u32 *find_page_index(mmc_t * mmcp, void *mp)
 {
 	_u32 page = PAGE_MASK & ((_u32) mp);
-	_u32 *p = mmcp->meta_base;
+	_u32 idx = (page - (_u32) mmcp->frame_base) / PAGE_SIZE;
 
-	while ((_u32) p < (_u32) (mmcp->meta_base) + mmcp->meta_len) {
-		if ((PAGE_MASK & (*p)) == page)
-			return p;
-		p++;
+	// meta entries are in the same order as frames
+	if (page < (_u32) mmcp->frame_base || idx >= mmcp->nframes)
+		return (_u32 *) NULL;
+	ASSERT((PAGE_MASK & mmcp->meta_base[idx]) == page);
+	return &mmcp->meta_base[idx];
+}
+
+// free frame with index out of [first, last), used by compaction
+static void *alloc_frame_outside(mmc_t * mmcp, _u32 first, _u32 last)
+{
+	_u32 n;
+	uint_t flags;
+	void *p = NULL;
+
+	flags = mmc_lock(mmcp);
+	for (n = 0; n < mmcp->nframes; n++) {
+		if (n == first) {
+			n = last - 1;
+			continue;
+		}
+		if (PGCOLOR(mmcp->meta_base[n]) == PG_WHITE) {
+			p = __mark_frames(mmcp, &mmcp->meta_base[n], 1);
+			break;
+		}
 	}
-	return (_u32 *) NULL;
+	mmc_unlock(mmcp, flags);
+	return p;
 }
 
 void *alloc_frames(mmc_t * mmcp, _u32 npages)
 {
-	_u32 *tp = find_seq_pages(mmcp, npages);
-	_u32 left, right, marker, n;
+	_u32 *tp;
+	uint_t flags;
+	void *p = NULL;
+
+	flags = mmc_lock(mmcp);
+	tp = find_seq_pages(mmcp, npages);
+	if (tp)
+		p = __mark_frames(mmcp, tp, npages);
+	mmc_unlock(mmcp, flags);
+	return p;
+}
 
-	if (!tp)
-		return NULL;
+// colour npages free frames from tp as one run
+static void *__mark_frames(mmc_t * mmcp, _u32 * tp, _u32 npages)
+{
+	_u32 left, right, marker, n;
 
 	// just put Red 
 	// |<R,R,R<|
@@ -523,10 +2076,11 @@ void *alloc_frames(mmc_t * mmcp, _u32 npages)
 		right = PGCOLOR(*(tp + npages));
 		left = PGCOLOR(*(tp - 1));
 
-		// left is PG_WHITE...not suppose to happen
-		ASSERT(left != PG_WHITE);
-
-		if (right == left || right == PG_WHITE)
+		// left is only PG_WHITE when compaction picks a frame right
+		// after its window, treat it like the first frame
+		if (left == PG_WHITE)
+			marker = PGCOLOR_SHIFT(right);
+		else if (right == left || right == PG_WHITE)
 			marker = PGCOLOR_SHIFT(left);
 		else
 			marker = PGCOLOR_XOR(left, right);
@@ -539,6 +2093,8 @@ void *alloc_frames(mmc_t * mmcp, _u32 npages)
 	}
 
 	mmcp->nfree -= npages;
+	if (mmcp == &mm_phys && mem_map)
+		mem_map_alloc(tp - mmcp->meta_base, npages);
 
 	log_dbg("alloc %d pg, free %d pg\n", npages, mmcp->nfree);
 	if (KLOG_DBG)
@@ -555,12 +2111,17 @@ int free_frames(mmc_t * mmcp, void *mp)
 {
 	_u32 *tp = find_page_index(mmcp, mp);
 	_u32 *left, *right, *edge;
-	_u32 marker = PGCOLOR(*tp);
+	_u32 marker;
+	uint_t flags;
 
 	if (!tp)
 		return 1;
-	if (marker == PG_WHITE)
+	flags = mmc_lock(mmcp);
+	marker = PGCOLOR(*tp);
+	if (marker == PG_WHITE) {
+		mmc_unlock(mmcp, flags);
 		return 1;
+	}
 
 	edge = tp;
 	for (left = tp - 1; left >= mmcp->meta_base; left--) {
@@ -579,11 +2140,14 @@ int free_frames(mmc_t * mmcp, void *mp)
 	right = edge;
 
 	mmcp->nfree += right - left + 1;
+	if (mmcp == &mm_phys && mem_map)
+		mem_map_free(left - mmcp->meta_base, right - left + 1);
 
 	while (left <= right) {
 		*left = PGCOLOR_RESET(*left);
 		left++;
 	}
+	mmc_unlock(mmcp, flags);
 
 	log_dbg("free 0x%08X, free %d pg\n", mp, mmcp->nfree);
 	if (KLOG_DBG)
@@ -12,6 +12,7 @@
 #include "string.h"
 #include "cpu.h"
 #include "klog.h"
+#include "locking.h"
 
 // global mp information
 mp_t mpinfo;
@@ -110,6 +111,42 @@ static mpconf_t *mpconfig(mpfp_t ** pmp)
 	return conf;
 }
 
+// processors listed in MP configuration, at least the boot processor
+int mp_count_cpus()
+{
+	uchar_t *p;
+	mpconf_t *conf;
+	mpfp_t *mp;
+	int ncpu = 0;
+
+	if ((conf = mpconfig(&mp)) == NULL)
+		return 1;
+
+	for (p = (uchar_t *) (conf + 1); p < (uchar_t *) conf + conf->length;) {
+		switch (*p) {
+		case MPPROC:
+			ncpu++;
+			p += sizeof(mpproc_t);
+			continue;
+		case MPIOAPIC:
+			p += sizeof(mpioapic_t);
+			continue;
+		case MPBUS:
+		case MPIOINTR:
+		case MPLINTR:
+			p += 8;
+			continue;
+		default:
+			// init_mp gets no further than this entry either
+			p = (uchar_t *) conf + conf->length;
+		}
+	}
+
+	if (ncpu > MAX_CPUS)
+		ncpu = MAX_CPUS;
+	return ncpu ? ncpu : 1;
+}
+
 int init_mp()
 {
 	uchar_t *p;
@@ -129,6 +166,12 @@ int init_mp()
 		switch (*p) {
 		case MPPROC:
 			proc = (mpproc_t *) p;
+			if (ncpu == MAX_CPUS) {
+				printk(LOG_MP "mpinit: apicid=%d over MAX_CPUS\n",
+				       proc->apicid);
+				p += sizeof(mpproc_t);
+				continue;
+			}
 			if (ncpu != proc->apicid) {
 				printk(LOG_MP
 				       "mpinit: ncpu=%d apicid=%d\n",
@@ -211,3 +254,45 @@ void smp_tick_others()
 
 	lapic_send_ipi_mcast(IRQ_TIMER);
 }
+
+// processors which have not flushed TLB yet for the current request, one
+// bit per index in cpuset
+static volatile uint_t tlb_flush_mask;
+static rawlock_t tlb_flush_lock;
+
+// ask other processors to flush TLB and wait till all of them are done.
+// Interrupts may be off, requests of others are served while waiting, so
+// two processors flushing at once do not wait for each other forever
+void smp_flush_tlb_others()
+{
+	uint_t self;
+
+	if (!mpinfo.ismp)
+		return;
+
+	self = 1 << (get_processor() - cpuset);
+	while (acquire_rlock(&tlb_flush_lock)) {
+		smp_flush_tlb_check();
+		cpu_relax();
+	}
+	tlb_flush_mask = ((1 << mpinfo.ncpu) - 1) & ~self;
+	lapic_send_ipi_mcast(IRQ_INVAL_TLB);
+	while (tlb_flush_mask)
+		cpu_relax();
+	release_rlock(&tlb_flush_lock);
+}
+
+// flush TLB if this processor is asked to, from the IPI handler or from
+// any loop that spins with interrupts off
+void smp_flush_tlb_check()
+{
+	uint_t bit;
+
+	if (tlb_flush_mask == 0)
+		return;
+	bit = 1 << (get_processor() - cpuset);
+	if (!(tlb_flush_mask & bit))
+		return;
+	flush_tlb_all();
+	asm volatile ("lock; andl %1, %0":"+m" (tlb_flush_mask):"r"(~bit));
+}
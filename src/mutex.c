@@ -63,6 +63,22 @@ void mutex_lock(mutex_t * lock)
 	spin_unlock_irqrestore(&lock->wlock);
 }
 
+// never sleeps, 1 if the lock is taken
+uint_t mutex_trylock(mutex_t * lock)
+{
+	uint_t got = 0;
+
+	spin_lock_irqsave(&lock->wlock);
+	if (!acquire_rlock(&lock->mlock)) {
+		ASSERT(lock->owner == NULL);
+		mutex_set_owner(lock);
+		got = 1;
+	}
+	spin_unlock_irqrestore(&lock->wlock);
+
+	return got;
+}
+
 void mutex_unlock(mutex_t * lock)
 {
 	mq_thread_t *p;
@@ -88,7 +88,7 @@ int init_ramfs(dev_t * dev)
 		goto bbuf_failed;
 
 	// init device specific metadata
-	ramfs = kmalloc(sizeof(dev_ramfs_t));
+	ramfs = kmalloc_aligned(sizeof(dev_ramfs_t), L1_CACHE_BYTES);
 	if (ramfs == NULL) {
 		err = -3;
 		goto heap_failed;
@@ -18,6 +18,7 @@
 #include "heap.h"
 #include "print.h"
 #include "timer.h"
+#include "slab.h"
 
 static cpu_state_t *pick_processor();
 static cpu_state_t *__pick_processor_fsr();
@@ -34,6 +35,7 @@ static int add_thread_to_rq(thread_t * threadp);
 static int remove_thread_from_rq();
 static int __remove_thread_from_rq(cpu_state_t * cpu, thread_t * threadp);
 static void *find_thread_in_rq(thread_t * threadp, list_head_t * q);
+static kmem_cache_t *rq_cachep;
 
 #define __set_thread_status(threadp, state) 		\
 	do {  						\
@@ -71,6 +73,10 @@ void schedule()
 	__set_thread_status(nextp, T_RUNNING);
 	cpu->rthread = nextp;
 
+	// user space of the next task, faults resolve against the loaded one
+	if (nextp->task->addr_space != NULL)
+		load_page_directory(nextp->task->addr_space);
+
 	// will re-enable preemption in switch_to(_init)
 	if (rthread != NULL) {
 		switch_to(&rthread->context, &nextp->context);
@@ -289,12 +295,21 @@ static int add_task_to_rq(task_t * taskp)
 	return 1;
 }
 
+// run queue entries come and go with every thread
+void init_rq_cache()
+{
+	rq_cachep = kmem_cache_create("rthread_list", sizeof(rthread_list_t),
+				      0, SLAB_HWCACHE_ALIGN, NULL);
+	if (rq_cachep == NULL)
+		PANIC("No cache for run queues");
+}
+
 static int add_thread_to_rq(thread_t * threadp)
 {
 	cpu_state_t *cpu;
 	rthread_list_t *ptr;
 
-	ptr = (rthread_list_t *) kmalloc(sizeof(rthread_list_t));
+	ptr = (rthread_list_t *) kmem_cache_alloc(rq_cachep);
 	if (ptr == NULL)
 		return 1;
 
@@ -322,8 +337,7 @@ static int __remove_thread_from_rq(cpu_state_t * cpu, thread_t * threadp)
 	if (entry == NULL)
 		return -1;
 	list_del(&entry->runq);
-	if (kfree(entry) != OK)
-		return -2;
+	kmem_cache_free(rq_cachep, entry);
 	spin_unlock_irqrestore(&cpu->rq_lock);
 
 	return OK;
@@ -0,0 +1,411 @@
+/*
+ *      Red Magic 1996 - 2015
+ *
+ *      slab.c - object caches for fixed-size kernel objects
+ *
+ *      2015 Lin Coin - initial version
+ */
+
+#include "common.h"
+#include "slab.h"
+#include "mm.h"
+#include "paging.h"
+#include "heap.h"
+#include "list.h"
+#include "locking.h"
+#include "string.h"
+#include "debug.h"
+#include "klog.h"
+
+#define SLAB_END 0xFFFF		// end of free index chain
+
+// slab header, on-slab before the objects or kmalloc'd for large objects,
+// bufctl chains free objects by index so that constructed objects are
+// never written by the allocator
+typedef struct slab {
+	list_head_t list;	// full, partial or empty list of the cache
+	kmem_cache_t *cache;
+	void *mem;		// first frame
+	void *s_mem;		// first object
+	uint_t inuse;
+	_u16 free;
+	_u16 bufctl[0];
+} slab_t;
+
+#define SLAB_HDR_SIZE(objs) (sizeof(slab_t) + (objs) * sizeof(_u16))
+
+// caches are objects of this cache
+static kmem_cache_t cache_cache;
+static LIST_HEAD(cache_list);
+static rawlock_t cache_list_lock;
+
+static int cache_estimate(kmem_cache_t * cachep);
+static slab_t *cache_grow(kmem_cache_t * cachep);
+static void slab_destroy(kmem_cache_t * cachep, slab_t * slabp);
+static slab_t *obj_to_slab(void *objp);
+static uint_t slab_count(shrinker_t * shrinker);
+static uint_t slab_scan(shrinker_t * shrinker, uint_t nr);
+static shrinker_t slab_shrinker = {
+	.count = slab_count,
+	.scan = slab_scan
+};
+
+static inline uint_t slab_lock_irqsave(rawlock_t * lock)
+{
+	uint_t flags;
+
+	flags = local_get_flags();
+	local_irq_disable();
+	lock_rlock(lock);
+
+	return flags;
+}
+
+static inline void slab_unlock_irqrestore(rawlock_t * lock, uint_t flags)
+{
+	release_rlock(lock);
+	local_set_flags(flags);
+}
+
+static int __cache_init(kmem_cache_t * cachep, const char *name, size_t size,
+			size_t align, _u32 flags, void (*ctor) (void *))
+{
+	uint_t lflags;
+
+	bzero(cachep, sizeof(kmem_cache_t));
+	if (flags & SLAB_HWCACHE_ALIGN)
+		align = L1_CACHE_BYTES;
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	// only powers of 2
+	if (align & (align - 1))
+		return 1;
+
+	cachep->name = name;
+	cachep->align = align;
+	cachep->size = (size + align - 1) & ~(align - 1);
+	cachep->flags = flags;
+	cachep->ctor = ctor;
+	INIT_LIST_HEAD(&cachep->full);
+	INIT_LIST_HEAD(&cachep->partial);
+	INIT_LIST_HEAD(&cachep->empty);
+	init_rlock(&cachep->lock);
+
+	if (cache_estimate(cachep))
+		return 1;
+
+	lflags = slab_lock_irqsave(&cache_list_lock);
+	list_add_tail(&cachep->list, &cache_list);
+	slab_unlock_irqrestore(&cache_list_lock, lflags);
+
+	return OK;
+}
+
+void init_slab()
+{
+	// every cache carries its own lock, keep them on separate lines
+	if (__cache_init(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0,
+			 SLAB_HWCACHE_ALIGN, NULL))
+		PANIC("Slab init failed");
+	if (register_shrinker(&slab_shrinker) != OK)
+		log_warn(LOG_MM "no shrinker for slabs\n");
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+				_u32 flags, void (*ctor) (void *))
+{
+	kmem_cache_t *cachep;
+
+	if (size == 0)
+		return NULL;
+
+	cachep = kmem_cache_alloc(&cache_cache);
+	if (cachep == NULL)
+		return NULL;
+
+	if (__cache_init(cachep, name, size, align, flags, ctor)) {
+		log_err(LOG_MM "bad cache %s, size %d align %d\n", name, size,
+			align);
+		kmem_cache_free(&cache_cache, cachep);
+		return NULL;
+	}
+
+	return cachep;
+}
+
+// objects must all be freed before
+int kmem_cache_destroy(kmem_cache_t * cachep)
+{
+	slab_t *slabp, *tmp;
+	uint_t flags;
+
+	flags = slab_lock_irqsave(&cachep->lock);
+	if (!list_empty(&cachep->full) || !list_empty(&cachep->partial)) {
+		slab_unlock_irqrestore(&cachep->lock, flags);
+		return 1;
+	}
+	slab_unlock_irqrestore(&cachep->lock, flags);
+
+	flags = slab_lock_irqsave(&cache_list_lock);
+	list_del(&cachep->list);
+	slab_unlock_irqrestore(&cache_list_lock, flags);
+
+	list_for_each_entry_safe(slabp, tmp, &cachep->empty, list) {
+		list_del(&slabp->list);
+		slab_destroy(cachep, slabp);
+	}
+	kmem_cache_free(&cache_cache, cachep);
+
+	return OK;
+}
+
+void *kmem_cache_alloc(kmem_cache_t * cachep)
+{
+	slab_t *slabp;
+	void *objp;
+	uint_t flags, idx;
+
+	flags = slab_lock_irqsave(&cachep->lock);
+	while (1) {
+		slabp = list_first_entry_or_null(&cachep->partial, slab_t, list);
+		if (slabp != NULL)
+			break;
+		slabp = list_first_entry_or_null(&cachep->empty, slab_t, list);
+		if (slabp != NULL) {
+			cachep->nr_empty--;
+			break;
+		}
+
+		// frames are allocated without the lock, a shrinker may run
+		slab_unlock_irqrestore(&cachep->lock, flags);
+		slabp = cache_grow(cachep);
+		flags = slab_lock_irqsave(&cachep->lock);
+		if (slabp == NULL) {
+			slab_unlock_irqrestore(&cachep->lock, flags);
+			return NULL;
+		}
+		list_add(&slabp->list, &cachep->partial);
+	}
+
+	idx = slabp->free;
+	ASSERT(idx != SLAB_END);
+	slabp->free = slabp->bufctl[idx];
+	slabp->inuse++;
+	cachep->nr_objs++;
+	if (slabp->free == SLAB_END)
+		list_move(&slabp->list, &cachep->full);
+	else
+		list_move(&slabp->list, &cachep->partial);
+	objp = (void *)((_u32) slabp->s_mem + idx * cachep->size);
+	slab_unlock_irqrestore(&cachep->lock, flags);
+
+	return objp;
+}
+
+void kmem_cache_free(kmem_cache_t * cachep, void *objp)
+{
+	slab_t *slabp;
+	uint_t flags, idx;
+
+	if (objp == NULL)
+		return;
+
+	slabp = obj_to_slab(objp);
+	ASSERT(slabp != NULL && slabp->cache == cachep);
+	idx = ((_u32) objp - (_u32) slabp->s_mem) / cachep->size;
+	ASSERT((_u32) objp == (_u32) slabp->s_mem + idx * cachep->size);
+
+	flags = slab_lock_irqsave(&cachep->lock);
+	slabp->bufctl[idx] = slabp->free;
+	slabp->free = idx;
+	slabp->inuse--;
+	cachep->nr_objs--;
+	if (slabp->inuse == 0) {
+		list_move(&slabp->list, &cachep->empty);
+		cachep->nr_empty++;
+	} else
+		list_move(&slabp->list, &cachep->partial);
+	slab_unlock_irqrestore(&cachep->lock, flags);
+}
+
+kmem_cache_t *kmem_cache_of(void *objp)
+{
+	slab_t *slabp = obj_to_slab(objp);
+
+	return slabp ? slabp->cache : NULL;
+}
+
+void show_slabs()
+{
+	kmem_cache_t *cachep;
+	uint_t flags;
+
+	printk("%-16s %6s %6s %6s %5s\n", "cache", "size", "objs", "empty",
+	       "pages");
+	flags = slab_lock_irqsave(&cache_list_lock);
+	list_for_each_entry(cachep, &cache_list, list) {
+		printk("%-16s %6d %6d %6d %5d\n", cachep->name, cachep->size,
+		       cachep->nr_objs, cachep->nr_empty, cachep->slab_pages);
+	}
+	slab_unlock_irqrestore(&cache_list_lock, flags);
+}
+
+// smallest slab wasting no more than 1/8 of its frames, small objects keep
+// the header on-slab. What is left over is used for colouring
+static int cache_estimate(kmem_cache_t * cachep)
+{
+	size_t total, hdr, used;
+	uint_t pages, objs;
+
+	cachep->off_slab = cachep->size >= SLAB_OFF_LIMIT;
+	for (pages = 1; pages <= SLAB_MAX_PAGES; pages++) {
+		total = pages * PAGE_SIZE;
+		if (cachep->off_slab) {
+			objs = total / cachep->size;
+			hdr = 0;
+		} else {
+			objs = (total - sizeof(slab_t)) /
+			    (cachep->size + sizeof(_u16));
+			hdr = (SLAB_HDR_SIZE(objs) + cachep->align - 1) &
+			    ~(cachep->align - 1);
+			while (objs > 0 && hdr + objs * cachep->size > total) {
+				objs--;
+				hdr = (SLAB_HDR_SIZE(objs) + cachep->align -
+				       1) & ~(cachep->align - 1);
+			}
+		}
+		if (objs >= SLAB_END)
+			objs = SLAB_END - 1;
+		if (objs == 0)
+			continue;
+
+		used = hdr + objs * cachep->size;
+		if ((total - used) * 8 <= total || pages == SLAB_MAX_PAGES) {
+			cachep->slab_pages = pages;
+			cachep->objs_per_slab = objs;
+			cachep->colour_max = (total - used) / cachep->align + 1;
+			return OK;
+		}
+	}
+
+	return 1;
+}
+
+static slab_t *cache_grow(kmem_cache_t * cachep)
+{
+	slab_t *slabp;
+	void *mem;
+	page_t *page;
+	uint_t n, colour, flags;
+
+	mem = get_free_pages(cachep->slab_pages);
+	if (mem == NULL)
+		return NULL;
+
+	if (cachep->off_slab) {
+		slabp = kmalloc(SLAB_HDR_SIZE(cachep->objs_per_slab));
+		if (slabp == NULL) {
+			free_pages(mem);
+			return NULL;
+		}
+		slabp->s_mem = mem;
+	} else {
+		slabp = mem;
+		slabp->s_mem = (void *)(((_u32) mem +
+					 SLAB_HDR_SIZE(cachep->objs_per_slab) +
+					 cachep->align - 1) &
+					~(cachep->align - 1));
+	}
+
+	// shift objects of each new slab by one more colour, so that the
+	// same objects of different slabs hit different cache lines
+	flags = slab_lock_irqsave(&cachep->lock);
+	colour = cachep->colour_next;
+	if (++cachep->colour_next >= cachep->colour_max)
+		cachep->colour_next = 0;
+	slab_unlock_irqrestore(&cachep->lock, flags);
+	slabp->s_mem = (void *)((_u32) slabp->s_mem + colour * cachep->align);
+
+	slabp->cache = cachep;
+	slabp->mem = mem;
+	slabp->inuse = 0;
+	slabp->free = 0;
+	for (n = 0; n < cachep->objs_per_slab; n++) {
+		slabp->bufctl[n] = n + 1;
+		if (cachep->ctor)
+			cachep->ctor((void *)((_u32) slabp->s_mem +
+					      n * cachep->size));
+	}
+	slabp->bufctl[n - 1] = SLAB_END;
+
+	for (n = 0; n < cachep->slab_pages; n++) {
+		page = phys_to_page((void *)__virt_to_phys(k_pdir, (_u32) mem +
+							   n * PAGE_SIZE));
+		set_page_owner(page, PGO_SLAB);
+		page->mapping = slabp;
+	}
+
+	return slabp;
+}
+
+static void slab_destroy(kmem_cache_t * cachep, slab_t * slabp)
+{
+	void *mem = slabp->mem;
+
+	if (cachep->off_slab)
+		kfree(slabp);
+	free_pages(mem);
+}
+
+static slab_t *obj_to_slab(void *objp)
+{
+	page_t *page;
+
+	page = phys_to_page((void *)__virt_to_phys(k_pdir, (_u32) objp));
+	if (page == NULL || page->owner != PGO_SLAB)
+		return NULL;
+	return page->mapping;
+}
+
+// frames of empty slabs
+static uint_t slab_count(shrinker_t * shrinker)
+{
+	kmem_cache_t *cachep;
+	uint_t flags, nr = 0;
+
+	flags = slab_lock_irqsave(&cache_list_lock);
+	list_for_each_entry(cachep, &cache_list, list)
+	    nr += cachep->nr_empty * cachep->slab_pages;
+	slab_unlock_irqrestore(&cache_list_lock, flags);
+
+	return nr;
+}
+
+static uint_t slab_scan(shrinker_t * shrinker, uint_t nr)
+{
+	kmem_cache_t *cachep;
+	slab_t *slabp;
+	uint_t flags, cflags, freed = 0;
+
+	flags = slab_lock_irqsave(&cache_list_lock);
+	list_for_each_entry(cachep, &cache_list, list) {
+		while (freed < nr) {
+			cflags = slab_lock_irqsave(&cachep->lock);
+			slabp = list_first_entry_or_null(&cachep->empty,
+							 slab_t, list);
+			if (slabp != NULL) {
+				list_del(&slabp->list);
+				cachep->nr_empty--;
+			}
+			slab_unlock_irqrestore(&cachep->lock, cflags);
+			if (slabp == NULL)
+				break;
+
+			slab_destroy(cachep, slabp);
+			freed += cachep->slab_pages;
+		}
+	}
+	slab_unlock_irqrestore(&cache_list_lock, flags);
+
+	return freed;
+}
@@ -74,9 +74,16 @@ void spin_unlock_irqrestore(spinlock_t * lock)
 	preempt_enable();
 }
 
+// the holder may be waiting for this processor to flush its TLB, serve
+// that while waiting in line
 static inline void spin_acquire(spinlock_t * lock)
 {
-	while (acquire_rlock(&lock->slock)) ;
+	_u16 ticket = xadd(&lock->slock.rlock, RLOCK_TICKET) >> 16;
+
+	while (lock->slock.t.owner != ticket) {
+		smp_flush_tlb_check();
+		cpu_relax();
+	}
 	ASSERT(lock->owner_cpu == NULL);
 	lock->owner_cpu = get_processor();
 }
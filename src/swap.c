@@ -0,0 +1,537 @@
+/*
+ *      Red Magic 1996 - 2015
+ *
+ *      swap.c - page reclaim and swap space
+ *
+ *      2015 Lin Coin - initial version
+ */
+
+#include "common.h"
+#include "swap.h"
+#include "mm.h"
+#include "paging.h"
+#include "device.h"
+#include "heap.h"
+#include "sched.h"
+#include "cpu.h"
+#include "locking.h"
+#include "string.h"
+#include "debug.h"
+#include "klog.h"
+
+// swap area, NULL if swap is not available
+static blk_dev_t *swap_bdev;
+
+// users of each slot, slot 0 is never handed out
+static _u8 *swap_map;
+static uint_t swap_nfree;
+static uint_t swap_next;
+static rawlock_t swap_lock;
+
+// anonymous pages, hot pages at the head, victims are taken from the tail
+// of inactive list
+static LIST_HEAD(active_list);
+static LIST_HEAD(inactive_list);
+static uint_t nr_active, nr_inactive;
+static rawlock_t lru_lock;
+
+#define SWAP_BATCH 16		// pages unmapped per TLB shootdown
+
+// what swap_unmap_page did to the entry of a page
+#define SWAP_KEEP  0		// nothing, the page stays
+#define SWAP_DROP  1		// swap entry installed, frame can go
+#define SWAP_WRITE 2		// write protected, page goes to swap first
+
+static _u32 swap_alloc();
+static uint_t isolate_inactive(page_t ** batch, uint_t max, uint_t * scan,
+			       int may_write);
+static int swap_unmap_page(page_t * page, int may_write, page_entry_t * oldp);
+static int swap_write_page(page_t * page, page_entry_t old);
+static page_entry_t *page_rmap_pte(page_t * page);
+static int test_clear_young(page_t * page);
+static void refill_inactive(uint_t nr);
+static uint_t shrink_inactive(uint_t nr, int may_write);
+static uint_t do_try_to_free_pages(uint_t nr, int may_write);
+
+// registered shrinkers, a slot is NULL if unused
+static shrinker_t *shrinkers[MAX_SHRINKERS];
+static rawlock_t shrinker_lock;
+
+// both locks are taken from page fault handler and put_page, which may run
+// with interrupts on or off
+static inline uint_t swap_lock_irqsave(rawlock_t * lock)
+{
+	uint_t flags;
+
+	flags = local_get_flags();
+	local_irq_disable();
+	lock_rlock(lock);
+
+	return flags;
+}
+
+static inline void swap_unlock_irqrestore(rawlock_t * lock, uint_t flags)
+{
+	release_rlock(lock);
+	local_set_flags(flags);
+}
+
+void init_swap()
+{
+	dev_t *dev;
+	blk_dev_t *bdev;
+
+	dev = get_dev_by_name(SWAP_DEV);
+	if (dev == NULL || !dev->enabled || dev->ptr == NULL) {
+		log_warn(LOG_SWAP "no swap device %s\n", SWAP_DEV);
+		return;
+	}
+	bdev = (blk_dev_t *) dev->ptr;
+
+	// one page goes through the buffer cache at a time
+	if (bdev->buf_num == 0
+	    && bdev_init_buffer_cache(bdev, BLKS_P_PAGE * 2) != OK) {
+		log_err(LOG_SWAP "buffer cache init failed\n");
+		return;
+	}
+
+	swap_map = (_u8 *) kmalloc(SWAP_PAGES);
+	if (swap_map == NULL) {
+		log_err(LOG_SWAP "could not allocate swap map\n");
+		return;
+	}
+	bzero(swap_map, SWAP_PAGES);
+	swap_map[0] = 1;
+	swap_nfree = SWAP_PAGES - 1;
+	swap_next = 1;
+	swap_bdev = bdev;
+
+	log_info(LOG_SWAP "%d KB on %s\n", (SWAP_PAGES - 1) * PAGE_SIZE / 1024,
+		 SWAP_DEV);
+}
+
+static _u32 swap_alloc()
+{
+	uint_t flags, n;
+	_u32 slot = 0;
+
+	flags = swap_lock_irqsave(&swap_lock);
+	for (n = 0; n < SWAP_PAGES && swap_nfree > 0; n++) {
+		if (swap_map[swap_next] == 0) {
+			slot = swap_next;
+			swap_map[slot] = 1;
+			swap_nfree--;
+			break;
+		}
+		if (++swap_next == SWAP_PAGES)
+			swap_next = 1;
+	}
+	swap_unlock_irqrestore(&swap_lock, flags);
+
+	return slot;
+}
+
+// swap entry copied into another address space
+void swap_dup(_u32 slot)
+{
+	uint_t flags;
+
+	flags = swap_lock_irqsave(&swap_lock);
+	ASSERT(slot > 0 && slot < SWAP_PAGES && swap_map[slot] > 0);
+	swap_map[slot]++;
+	swap_unlock_irqrestore(&swap_lock, flags);
+}
+
+void swap_free(_u32 slot)
+{
+	uint_t flags;
+
+	flags = swap_lock_irqsave(&swap_lock);
+	ASSERT(slot > 0 && slot < SWAP_PAGES && swap_map[slot] > 0);
+	if (--swap_map[slot] == 0)
+		swap_nfree++;
+	swap_unlock_irqrestore(&swap_lock, flags);
+}
+
+int swap_read_page(_u32 slot, void *page)
+{
+	_u32 blkno = SWAP_START_BLK + slot * BLKS_P_PAGE;
+	uint_t n;
+
+	for (n = 0; n < BLKS_P_PAGE; n++)
+		if (bdev_read_buffer(swap_bdev, blkno + n,
+				     (char *)page + n * BLOCK_SIZE) != OK)
+			return 1;
+	return OK;
+}
+
+void lru_add_page(page_t * page)
+{
+	uint_t flags;
+
+	flags = swap_lock_irqsave(&lru_lock);
+	if (!(page->flags & PG_LRU)) {
+		page->flags |= PG_LRU | PG_ACTIVE;
+		list_add(&page->lru, &active_list);
+		nr_active++;
+	}
+	swap_unlock_irqrestore(&lru_lock, flags);
+}
+
+void lru_del_page(page_t * page)
+{
+	uint_t flags;
+
+	flags = swap_lock_irqsave(&lru_lock);
+	if (page->flags & PG_LRU) {
+		list_del_init(&page->lru);
+		if (page->flags & PG_ACTIVE)
+			nr_active--;
+		else
+			nr_inactive--;
+		page->flags &= ~(PG_LRU | PG_ACTIVE);
+	}
+	swap_unlock_irqrestore(&lru_lock, flags);
+}
+
+// the only mapping of an anonymous page, NULL if the page is shared or the
+// recorded mapping is gone
+static page_entry_t *page_rmap_pte(page_t * page)
+{
+	page_entry_t *ptep;
+
+	if (page->mapping == NULL || page->count != 1)
+		return NULL;
+	ptep = get_page_entry((void *)page->index, page->mapping);
+	if (ptep == NULL || !(*ptep & PAGE_PRESENT)
+	    || (*ptep & PTE_ADDR_MASK) != (_u32) page_to_phys(page))
+		return NULL;
+	return ptep;
+}
+
+// the copy in swap is still valid, dirty bit is set by processor on the
+// first write through the mapping
+static int page_is_clean(page_t * page, page_entry_t pte)
+{
+	return page->swap != 0 && !(pte & PAGE_DIRTY);
+}
+
+// accessed bit is set by processor on every access through the mapping
+static int test_clear_young(page_t * page)
+{
+	page_entry_t *ptep = page_rmap_pte(page);
+	page_entry_t pte;
+
+	if (ptep == NULL)
+		return 0;
+	do {
+		pte = *ptep;
+		if (!(pte & PAGE_ACCESSED))
+			return 0;
+	} while (pte_cmpxchg(ptep, pte, pte & ~PAGE_ACCESSED) != pte);
+
+	return 1;
+}
+
+// age pages from the tail of active list, those used since the last scan
+// go back to the head
+static void refill_inactive(uint_t nr)
+{
+	page_t *page;
+	uint_t flags;
+
+	flags = swap_lock_irqsave(&lru_lock);
+	for (; nr > 0 && !list_empty(&active_list); nr--) {
+		page = list_last_entry(&active_list, page_t, lru);
+		if (test_clear_young(page)) {
+			list_move(&page->lru, &active_list);
+			continue;
+		}
+		list_move(&page->lru, &inactive_list);
+		page->flags &= ~PG_ACTIVE;
+		nr_active--;
+		nr_inactive++;
+	}
+	swap_unlock_irqrestore(&lru_lock, flags);
+}
+
+// swap out up to nr pages from the tail of inactive list. Pages are taken
+// off the list and pinned in batches of SWAP_BATCH, the entries of a batch
+// are changed first and TLBs of all processors are flushed once for them.
+// Without may_write only clean pages are dropped, the others rotate for
+// kswapd to write
+static uint_t shrink_inactive(uint_t nr, int may_write)
+{
+	page_t *batch[SWAP_BATCH];
+	page_entry_t old[SWAP_BATCH];
+	uint_t n, nr_batch, max, scan, reclaimed = 0;
+	_u32 writing, dropped;
+
+	scan = nr_inactive;
+	while (scan > 0 && reclaimed < nr) {
+		max = nr - reclaimed < SWAP_BATCH ? nr - reclaimed : SWAP_BATCH;
+		nr_batch = isolate_inactive(batch, max, &scan, may_write);
+		if (nr_batch == 0)
+			break;
+
+		writing = dropped = 0;
+		for (n = 0; n < nr_batch; n++)
+			switch (swap_unmap_page(batch[n], may_write, &old[n])) {
+			case SWAP_DROP:
+				dropped |= 1 << n;
+				break;
+			case SWAP_WRITE:
+				writing |= 1 << n;
+				break;
+			}
+
+		// nothing writes through a stale writable entry during IO
+		if (writing) {
+			flush_tlb_all();
+			smp_flush_tlb_others();
+		}
+		for (n = 0; n < nr_batch; n++)
+			if ((writing & (1 << n))
+			    && swap_write_page(batch[n], old[n]) == OK)
+				dropped |= 1 << n;
+
+		// frames are freed only when no processor can reach them
+		if (dropped) {
+			flush_tlb_all();
+			smp_flush_tlb_others();
+		}
+		for (n = 0; n < nr_batch; n++) {
+			if (dropped & (1 << n)) {
+				// drop the reference of the mapping
+				batch[n]->mapping = NULL;
+				put_page(batch[n]);
+				reclaimed++;
+			} else
+				lru_add_page(batch[n]);
+			put_page(batch[n]);
+		}
+	}
+
+	return reclaimed;
+}
+
+// take up to max victims off the tail of inactive list with a reference
+// each, scan counts down the pages looked at
+static uint_t isolate_inactive(page_t ** batch, uint_t max, uint_t * scan,
+			       int may_write)
+{
+	page_entry_t *ptep;
+	page_t *page;
+	uint_t flags, nr_batch = 0;
+
+	flags = swap_lock_irqsave(&lru_lock);
+	for (; *scan > 0 && nr_batch < max; (*scan)--) {
+		if (list_empty(&inactive_list)) {
+			*scan = 0;
+			break;
+		}
+		page = list_last_entry(&inactive_list, page_t, lru);
+		if (test_clear_young(page)
+		    || (ptep = page_rmap_pte(page)) == NULL) {
+			list_move(&page->lru, &active_list);
+			page->flags |= PG_ACTIVE;
+			nr_inactive--;
+			nr_active++;
+			continue;
+		}
+		if (!may_write && !page_is_clean(page, *ptep)) {
+			list_move(&page->lru, &inactive_list);
+			continue;
+		}
+		list_del_init(&page->lru);
+		page->flags &= ~PG_LRU;
+		nr_inactive--;
+		get_page(page);
+		batch[nr_batch++] = page;
+	}
+	swap_unlock_irqrestore(&lru_lock, flags);
+
+	return nr_batch;
+}
+
+// a clean page only drops its mapping, the entry takes over the slot.
+// Otherwise the entry is write protected for the write-out and a new slot
+// is kept in page->swap. The caller flushes TLBs after either change, the
+// entry seen before is left in *oldp
+static int swap_unmap_page(page_t * page, int may_write, page_entry_t * oldp)
+{
+	page_entry_t *ptep, old, ro;
+
+	ptep = get_page_entry((void *)page->index, page->mapping);
+	if (ptep == NULL)
+		return SWAP_KEEP;
+	old = *ptep;
+	if (!(old & PAGE_PRESENT) || (old & PTE_ADDR_MASK) != (_u32)
+	    page_to_phys(page))
+		return SWAP_KEEP;
+	*oldp = old;
+
+	// processor sets dirty bit atomically in the entry, a write racing
+	// with this fails the exchange
+	if (page_is_clean(page, old)) {
+		if (pte_cmpxchg(ptep, old, SWP_ENTRY(page->swap, old)) != old)
+			return SWAP_KEEP;
+		page->swap = 0;
+		return SWAP_DROP;
+	}
+	if (!may_write)
+		return SWAP_KEEP;
+
+	// the copy in swap is stale
+	if (page->swap)
+		swap_free(page->swap);
+	page->swap = swap_alloc();
+	if (page->swap == 0)
+		return SWAP_KEEP;
+
+	ro = (old & PAGE_WRITE) ? ((old & ~PAGE_WRITE) | PAGE_COW) : old;
+	if (pte_cmpxchg(ptep, old, ro) != old) {
+		swap_free(page->swap);
+		page->swap = 0;
+		return SWAP_KEEP;
+	}
+	return SWAP_WRITE;
+}
+
+// write a page protected by swap_unmap_page to its slot, a write in between
+// went through COW fault and the page is kept
+static int swap_write_page(page_t * page, page_entry_t old)
+{
+	page_entry_t *ptep, ro, cur;
+	_u32 blkno;
+	char *va;
+	uint_t n;
+
+	va = (char *)__phys_to_virt_lm(NULL, (_u32) page_to_phys(page));
+	blkno = SWAP_START_BLK + page->swap * BLKS_P_PAGE;
+	for (n = 0; n < BLKS_P_PAGE; n++)
+		if (bdev_write_buffer(swap_bdev, blkno + n, va + n * BLOCK_SIZE)
+		    != OK)
+			goto err;
+	if (bdev_sync_buffer(swap_bdev) != 0)
+		goto err;
+
+	// entry stays write protected if anything failed, the next write
+	// simply takes it back through COW fault
+	ptep = get_page_entry((void *)page->index, page->mapping);
+	if (ptep == NULL)
+		goto err;
+	ro = (old & PAGE_WRITE) ? ((old & ~PAGE_WRITE) | PAGE_COW) : old;
+	cur = *ptep;
+	if ((cur & ~PAGE_ACCESSED) != (ro & ~PAGE_ACCESSED))
+		goto err;
+	if (pte_cmpxchg(ptep, cur, SWP_ENTRY(page->swap, old)) != cur)
+		goto err;
+	page->swap = 0;
+	return OK;
+
+      err:
+	swap_free(page->swap);
+	page->swap = 0;
+	return 1;
+}
+
+int register_shrinker(shrinker_t * shrinker)
+{
+	uint_t flags, n;
+	int rv = 1;
+
+	flags = swap_lock_irqsave(&shrinker_lock);
+	for (n = 0; n < MAX_SHRINKERS; n++) {
+		if (shrinkers[n] == NULL) {
+			shrinkers[n] = shrinker;
+			rv = OK;
+			break;
+		}
+	}
+	swap_unlock_irqrestore(&shrinker_lock, flags);
+
+	return rv;
+}
+
+// the shrinker may still be running on another processor when this
+// returns, it must not go away before the next reclaim pass is over
+void unregister_shrinker(shrinker_t * shrinker)
+{
+	uint_t flags, n;
+
+	flags = swap_lock_irqsave(&shrinker_lock);
+	for (n = 0; n < MAX_SHRINKERS; n++)
+		if (shrinkers[n] == shrinker)
+			shrinkers[n] = NULL;
+	swap_unlock_irqrestore(&shrinker_lock, flags);
+}
+
+// ask every cache for a share of its objects, at least nr of each. Returns
+// frames that became free meanwhile
+uint_t shrink_caches(uint_t nr)
+{
+	shrinker_t *shrinker, *list[MAX_SHRINKERS];
+	uint_t n, count, flags, nfree = mm_phys.nfree;
+
+	// shrinkers run without the lock, they may take their own locks
+	flags = swap_lock_irqsave(&shrinker_lock);
+	memcpy((char *)list, (char *)shrinkers, sizeof(shrinkers));
+	swap_unlock_irqrestore(&shrinker_lock, flags);
+
+	for (n = 0; n < MAX_SHRINKERS; n++) {
+		shrinker = list[n];
+		if (shrinker == NULL)
+			continue;
+		count = shrinker->count(shrinker);
+		if (count == 0)
+			continue;
+		if (count > count / SHRINK_RATIO + nr)
+			count = count / SHRINK_RATIO + nr;
+		shrinker->scan(shrinker, count);
+	}
+
+	return mm_phys.nfree > nfree ? mm_phys.nfree - nfree : 0;
+}
+
+// direct reclaim of an allocation, no IO is done as it may come from page
+// fault handler. Dirty pages are left to kswapd
+uint_t try_to_free_pages(uint_t nr)
+{
+	return do_try_to_free_pages(nr, 0);
+}
+
+// caches go first since dropping them costs no IO, then keep inactive list
+// about as long as active list and swap out from it
+static uint_t do_try_to_free_pages(uint_t nr, int may_write)
+{
+	uint_t reclaimed, pass;
+
+	reclaimed = shrink_caches(nr);
+	if (swap_bdev == NULL)
+		return reclaimed;
+
+	for (pass = 0; pass < 2 && reclaimed < nr; pass++) {
+		if (nr_inactive < nr_active)
+			refill_inactive(nr * 2);
+		reclaimed += shrink_inactive(nr - reclaimed, may_write);
+	}
+
+	log_dbg(LOG_SWAP "reclaimed %d of %d page(s)\n", reclaimed, nr);
+	return reclaimed;
+}
+
+// background reclaim, keeps free frames between the watermarks so that
+// allocations rarely need to reclaim by themselves. Only kswapd writes pages
+// out
+int kswapd(void *args)
+{
+	for (;;) {
+		if (mm_phys.nfree < WMARK_LOW)
+			while (mm_phys.nfree < WMARK_HIGH
+			       && do_try_to_free_pages(SWAP_CLUSTER, 1) > 0) ;
+		pause(1);
+	}
+
+	return 0;
+}
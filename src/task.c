@@ -15,9 +15,17 @@
 #include "klog.h"
 #include "string.h"
 #include "timer.h"
+#include "slab.h"
+#include "locking.h"
 
 // default task group including all user tasks
 static task_group_t all_tasks;
+static spinlock_t all_tasks_lock;	// task list and their addr_space
+
+// task and thread structs and kernel stacks
+static kmem_cache_t *task_cachep;
+static kmem_cache_t *thread_cachep;
+static kmem_cache_t *stack_cachep;
 
 // task group functions, make sure init the task group before using it
 static void init_task_group(task_group_t * task_group);
@@ -33,6 +41,7 @@ static thread_t *__create_thread(task_t * task, int (*fn) (void *), void *arg);
 
 // thread exits here also checks if task should be cleaned up
 static void __finish_thread();
+static void release_addr_space(task_t * taskp);
 
 // generate task id for newly created task
 static task_id_t alloc_task_id();
@@ -46,6 +55,17 @@ void setup_init_task()
 {
 	task_id_t tid;
 
+	task_cachep = kmem_cache_create("task", sizeof(task_t), 0,
+					SLAB_HWCACHE_ALIGN, NULL);
+	thread_cachep = kmem_cache_create("thread", sizeof(thread_t), 0,
+					  SLAB_HWCACHE_ALIGN, NULL);
+	stack_cachep = kmem_cache_create("thread_stack", T_STACK_SIZE, 0,
+					 SLAB_HWCACHE_ALIGN, NULL);
+	if (!task_cachep || !thread_cachep || !stack_cachep)
+		PANIC("No caches for tasks");
+	init_rq_cache();
+
+	spin_lock_init(&all_tasks_lock);
 	init_task_group(&all_tasks);
 	tid = create_kernel_task(K_INIT, NULL);
 	if (!tid)
@@ -59,14 +79,50 @@ static void init_task_group(task_group_t * task_group)
 
 static void add_to_task_group(task_group_t * task_group, task_t * task)
 {
+	spin_lock(&all_tasks_lock);
 	list_add_tail(&task->task_list, &task_group->task_list);
+	spin_unlock(&all_tasks_lock);
+}
+
+// call fn on page directory of every task, directories are not released
+// before fn returns
+void for_each_addr_space(void (*fn) (page_directory_t *, void *), void *arg)
+{
+	task_t *taskp;
+
+	spin_lock(&all_tasks_lock);
+	list_for_each_entry(taskp, &all_tasks.task_list, task_list) {
+		if (taskp->addr_space != NULL)
+			fn(taskp->addr_space, arg);
+	}
+	spin_unlock(&all_tasks_lock);
+}
+
+// drop the page directory of a task, the last thread exits on it so fall
+// back to k_pdir before freeing
+static void release_addr_space(task_t * taskp)
+{
+	page_directory_t *pdir;
+
+	// walkers of the task list may be using it
+	spin_lock(&all_tasks_lock);
+	pdir = taskp->addr_space;
+	taskp->addr_space = NULL;
+	spin_unlock(&all_tasks_lock);
+	if (pdir == NULL || pdir == k_pdir)
+		return;
+	if (pdir == get_curr_page_directory())
+		load_page_directory(k_pdir);
+	free_page_directory(pdir);
 }
 
 task_id_t create_task(int (*fn) (void *), void *arg)
 {
 	task_t *taskp;
 
-	taskp = __create_task(&all_tasks, 0, NULL, NULL, NULL, 0, fn, arg);
+	// new task shares user pages of current task as copy-on-write
+	taskp = __create_task(&all_tasks, 0, NULL, NULL, get_curr_task(), 0,
+			      fn, arg);
 	if (init_task_sched(taskp))
 		log_err("could not add to rq\n");
 
@@ -91,10 +147,9 @@ static task_t *__create_task(task_group_t * task_group,
 			     void *arg)
 {
 	task_t *taskp = NULL;
-	mmc_t *mmcp = NULL;
 
 	// + create task struct and set the task as INIT status
-	taskp = (task_t *) kmalloc(sizeof(task_t));
+	taskp = (task_t *) kmem_cache_alloc(task_cachep);
 	if (taskp == NULL) {
 		log_err("could not allocate task struct\n");
 		goto c_err;
@@ -117,25 +172,24 @@ static task_t *__create_task(task_group_t * task_group,
 		taskp->task_id = task_id;
 	}
 
-	// + initialize address space
-	if (mm == NULL) {
-		mmcp = (mmc_t *) kmalloc(sizeof(mmc_t));
-		if (mmcp == NULL) {
-			log_err("memory struct allocation error\n");
-			goto c_err;
-		}
-		taskp->mm = mmcp;
-	} else
-		taskp->mm = mm;
+	// + initialize address space, user ranges are reserved by vm_map
+	taskp->mm = mm;
+	vm_space_init(&taskp->vm);
 
 	// + set address space (high memory area)
 	if (addr_space == NULL) {
-		taskp->addr_space = (page_directory_t *) get_zeroed_page();
+		taskp->addr_space = alloc_page_directory();
 		if (taskp->addr_space == NULL) {
 			log_err("could not setup page directory\n");
 			goto c_err;
 		}
-		copy_page_directory_from(k_pdir, taskp->addr_space);
+		if (parent != NULL && parent->addr_space != NULL
+		    && (copy_address_space(parent->addr_space,
+					   taskp->addr_space)
+			|| vm_space_copy(&parent->vm, &taskp->vm))) {
+			log_err("could not duplicate address space\n");
+			goto c_err;
+		}
 	} else
 		taskp->addr_space = addr_space;
 
@@ -149,7 +203,7 @@ static task_t *__create_task(task_group_t * task_group,
 	INIT_LIST_HEAD(&taskp->thread_list);
 	if (!__create_thread(taskp, fn, arg)) {
 		log_err("could not create thread\n");
-		return 0;
+		goto c_err;
 	}
 	// + add to task group
 	add_to_task_group(task_group, taskp);
@@ -157,10 +211,13 @@ static task_t *__create_task(task_group_t * task_group,
 	return taskp;
 
       c_err:
-	if (taskp != NULL)
-		kfree(taskp);
-	if (mmcp != NULL)
-		kfree(mmcp);
+	if (taskp != NULL) {
+		// only the directory allocated here is ours to free
+		if (addr_space == NULL)
+			release_addr_space(taskp);
+		vm_space_free(&taskp->vm);
+		kmem_cache_free(task_cachep, taskp);
+	}
 
 	// this 0 stands for failure
 	return NULL;
@@ -186,7 +243,7 @@ static thread_t *__create_thread(task_t * task, int (*fn) (void *), void *arg)
 	addr_t top;
 
 	// alloc thread struct
-	threadp = (thread_t *) kmalloc(sizeof(thread_t));
+	threadp = (thread_t *) kmem_cache_alloc(thread_cachep);
 	if (threadp == NULL) {
 		log_err("could not alloc thread struct\n");
 		goto thr_err;
@@ -201,7 +258,7 @@ static thread_t *__create_thread(task_t * task, int (*fn) (void *), void *arg)
 
 	// initialize kernel stack, user stack should be initialized when the
 	// first time the new thread is scheduled
-	stackp = kmalloc(T_STACK_SIZE);
+	stackp = kmem_cache_alloc(stack_cachep);
 	if (stackp == NULL) {
 		log_err("could not alloc stack space\n");
 		goto thr_err;
@@ -226,7 +283,7 @@ static thread_t *__create_thread(task_t * task, int (*fn) (void *), void *arg)
 	// initialize context structure
 	threadp->context.esp = top;
 	// make sure interrupt is switched ON
-	threadp->context.eflags = 0x200;
+	threadp->context.eflags = EFLAGS_IF;
 #endif
 
 	// reset inner alarm
@@ -240,7 +297,7 @@ static thread_t *__create_thread(task_t * task, int (*fn) (void *), void *arg)
 
       thr_err:
 	if (threadp != NULL)
-		kfree(threadp);
+		kmem_cache_free(thread_cachep, threadp);
 	return NULL;
 }
 
@@ -260,8 +317,13 @@ static int verify_task_id(task_group_t * tgrp, task_id_t tid)
 
 static void __finish_thread()
 {
+	thread_t *thr = get_curr_thread();
+
 	preempt_disable();
 
+	arena_destroy(thr->arena);
+	thr->arena = NULL;
+
 	// clean struct in runq, OK, we only cleanup thread structs when the
 	// task is going to exit.
 	clean_thread_sched();
@@ -271,7 +333,8 @@ static void __finish_thread()
 		// TODO clean stack
 
 		clean_task_sched();
-		// TODO release resources (mm, addrspaces, etc)
+		release_addr_space(thr->task);
+		// TODO release resources (mm, etc)
 		// TODO clean task struct
 	}
 	printk("Thread finished \n");
@@ -44,6 +44,12 @@ static void timer_callback(registers_t * regs)
 	}
 }
 
+// ticks of the boot processor since the clock was started
+uint_t get_ticks()
+{
+	return ticks;
+}
+
 void init_pit_timer(_u32 frequency)
 {
 	// Firstly, register our timer callback.
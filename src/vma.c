@@ -0,0 +1,284 @@
+/*
+ *      Red Magic 1996 - 2015
+ *
+ *      vma.c - virtual memory areas of user tasks
+ *
+ *      2015 Lin Coin - initial version
+ */
+
+#include "common.h"
+#include "vma.h"
+#include "avltree.h"
+#include "task.h"
+#include "sched.h"
+#include "mm.h"
+#include "paging.h"
+#include "heap.h"
+#include "locking.h"
+#include "debug.h"
+#include "klog.h"
+
+static spinlock_t vma_lock;	// zero is unlocked
+
+static vma_t *find_vma(vm_space_t * vm, _u32 addr);
+static int vma_cmp(avl_node_t * a, avl_node_t * b);
+static void vma_insert(vm_space_t * vm, vma_t * vma);
+static void vma_remove(vm_space_t * vm, vma_t * vma);
+static int find_gap(avl_node_t * node, _u32 * addr, _u32 len);
+static int copy_vmas(avl_node_t * node, vm_space_t * dst);
+static void free_vmas(avl_node_t * node);
+
+void vm_space_init(vm_space_t * vm)
+{
+	vm->root = NULL;
+	vm->cache = NULL;
+}
+
+// duplicate areas for a child sharing the address space as copy-on-write
+int vm_space_copy(vm_space_t * src, vm_space_t * dst)
+{
+	int ret;
+
+	spin_lock(&vma_lock);
+	ret = copy_vmas(src->root, dst);
+	spin_unlock(&vma_lock);
+
+	return ret;
+}
+
+void vm_space_free(vm_space_t * vm)
+{
+	spin_lock(&vma_lock);
+	free_vmas(vm->root);
+	vm->root = NULL;
+	vm->cache = NULL;
+	spin_unlock(&vma_lock);
+}
+
+int lookup_vma(vm_space_t * vm, _u32 addr, vma_t * vma)
+{
+	vma_t *found;
+
+	spin_lock(&vma_lock);
+	found = find_vma(vm, addr);
+	if (found == NULL || found->start > addr) {
+		spin_unlock(&vma_lock);
+		return 1;
+	}
+	*vma = *found;
+	spin_unlock(&vma_lock);
+
+	return OK;
+}
+
+// first area ending above addr, NULL if none
+static vma_t *find_vma(vm_space_t * vm, _u32 addr)
+{
+	avl_node_t *node = vm->root;
+	vma_t *vma, *found = NULL;
+
+	if (vm->cache && vm->cache->start <= addr && vm->cache->end > addr)
+		return vm->cache;
+
+	while (node != NULL) {
+		vma = avl_entry(node, vma_t, node);
+		if (vma->end > addr) {
+			found = vma;
+			if (vma->start <= addr)
+				break;
+			node = node->left;
+		} else
+			node = node->right;
+	}
+
+	if (found != NULL && found->start <= addr)
+		vm->cache = found;
+	return found;
+}
+
+// nothing is mapped here, pages are populated by page faults
+void *vm_map(void *addr, size_t len, _u32 flags)
+{
+	task_t *task = get_curr_task();
+	vm_space_t *vm;
+	vma_t *vma, *next;
+	_u32 start;
+
+	// areas are populated in the task's own directory
+	if (task == NULL || task->addr_space == NULL || len == 0
+	    || ((_u32) addr & ~PAGE_MASK))
+		return NULL;
+	if (len > K_HMEM_END - get_high_mem_start())
+		return NULL;
+	len = PAGE_ALIGN(len);
+
+	vma = kmalloc(sizeof(vma_t));
+	if (vma == NULL)
+		return NULL;
+	vma->flags = flags;
+
+	vm = &task->vm;
+	spin_lock(&vma_lock);
+	if (addr == NULL) {
+		// no gap between areas leaves start after the last one
+		start = get_high_mem_start();
+		find_gap(vm->root, &start, len);
+		if (K_HMEM_END - start < len)
+			goto err;
+	} else {
+		start = (_u32) addr;
+		if (start < get_high_mem_start() || start > K_HMEM_END - len)
+			goto err;
+		next = find_vma(vm, start);
+		if (next != NULL && next->start < start + len)
+			goto err;
+	}
+
+	vma->start = start;
+	vma->end = start + len;
+	vma_insert(vm, vma);
+	spin_unlock(&vma_lock);
+
+	return (void *)start;
+
+      err:
+	spin_unlock(&vma_lock);
+	kfree(vma);
+	return NULL;
+}
+
+// areas covering part of the range are trimmed or split, frames and swap
+// slots of the range are released
+int vm_unmap(void *addr, size_t len)
+{
+	task_t *task = get_curr_task();
+	vm_space_t *vm;
+	vma_t *vma, *tail;
+	_u32 start = (_u32) addr, end;
+	int ret;
+
+	if (task == NULL || task->addr_space == NULL || len == 0
+	    || (start & ~PAGE_MASK))
+		return 1;
+	end = start + PAGE_ALIGN(len);
+	if (start < get_high_mem_start() || end > K_HMEM_END || end < start)
+		return 1;
+
+	// only one area can stick out on both sides
+	tail = kmalloc(sizeof(vma_t));
+	if (tail == NULL)
+		return 1;
+
+	vm = &task->vm;
+	spin_lock(&vma_lock);
+	while ((vma = find_vma(vm, start)) != NULL && vma->start < end) {
+		if (vma->start >= start && vma->end <= end) {
+			vma_remove(vm, vma);
+			kfree(vma);
+		} else if (vma->start >= start) {
+			// start is the key, order among neighbours is kept
+			vma->start = end;
+		} else if (vma->end <= end) {
+			vma->end = start;
+		} else {
+			tail->start = end;
+			tail->end = vma->end;
+			tail->flags = vma->flags;
+			vma->end = start;
+			vma_insert(vm, tail);
+			tail = NULL;
+		}
+	}
+	vm->cache = NULL;
+	// frames go away under the lock, compaction may be moving them
+	ret = page_unmap_user((void *)start, (end - start) / PAGE_SIZE,
+			      task->addr_space);
+	spin_unlock(&vma_lock);
+
+	if (tail != NULL)
+		kfree(tail);
+
+	return ret;
+}
+
+// page migration keeps vm_unmap away from the pages it moves, 1 if taken
+uint_t vma_trylock()
+{
+	return spin_trylock(&vma_lock);
+}
+
+void vma_unlock()
+{
+	spin_unlock(&vma_lock);
+}
+
+static int vma_cmp(avl_node_t * a, avl_node_t * b)
+{
+	_u32 sa = avl_entry(a, vma_t, node)->start;
+	_u32 sb = avl_entry(b, vma_t, node)->start;
+
+	return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+static void vma_insert(vm_space_t * vm, vma_t * vma)
+{
+	vm->root = avl_insert(vm->root, &vma->node, vma_cmp);
+}
+
+static void vma_remove(vm_space_t * vm, vma_t * vma)
+{
+	vm->root = avl_remove(vm->root, &vma->node, vma_cmp);
+	if (vm->cache == vma)
+		vm->cache = NULL;
+}
+
+// in-order walk, *addr moves past each area until a gap of len is found
+static int find_gap(avl_node_t * node, _u32 * addr, _u32 len)
+{
+	vma_t *vma;
+
+	if (node == NULL)
+		return 1;
+
+	vma = avl_entry(node, vma_t, node);
+	if (vma->start > *addr && find_gap(node->left, addr, len) == OK)
+		return OK;
+	if (vma->start >= *addr && vma->start - *addr >= len)
+		return OK;
+	if (vma->end > *addr)
+		*addr = vma->end;
+	return find_gap(node->right, addr, len);
+}
+
+static int copy_vmas(avl_node_t * node, vm_space_t * dst)
+{
+	vma_t *vma, *newp;
+
+	if (node == NULL)
+		return OK;
+
+	vma = avl_entry(node, vma_t, node);
+	newp = kmalloc(sizeof(vma_t));
+	if (newp == NULL) {
+		log_err(LOG_MM "no memory for vma 0x%08X\n", vma->start);
+		return 1;
+	}
+	newp->start = vma->start;
+	newp->end = vma->end;
+	newp->flags = vma->flags;
+	vma_insert(dst, newp);
+
+	if (copy_vmas(node->left, dst))
+		return 1;
+	return copy_vmas(node->right, dst);
+}
+
+static void free_vmas(avl_node_t * node)
+{
+	if (node == NULL)
+		return;
+
+	free_vmas(node->left);
+	free_vmas(node->right);
+	kfree(avl_entry(node, vma_t, node));
+}
@@ -0,0 +1,167 @@
+/*
+ *      Red Magic 1996 - 2015
+ *
+ *      vmalloc.c - virtually contiguous kernel memory
+ *
+ *      2015 Lin Coin - initial version
+ */
+
+#include "common.h"
+#include "vmalloc.h"
+#include "heap.h"
+#include "mm.h"
+#include "paging.h"
+#include "mp.h"
+#include "locking.h"
+#include "list.h"
+#include "debug.h"
+#include "klog.h"
+
+typedef struct vm_area {
+	_u32 addr;		// first page of the area
+	size_t npg;		// pages including the guard page
+	_u32 flags;
+	struct list_head list;
+} vm_area_t;
+
+// areas sorted by address
+static LIST_HEAD(vm_areas);
+static spinlock_t vm_lock;	// zero is unlocked
+
+static vm_area_t *get_vm_area(size_t npg, _u32 flags);
+static void free_vm_pages(_u32 addr, size_t npg);
+
+int is_vmalloc_addr(_u32 addr)
+{
+	return addr >= VMALLOC_START && addr < VMALLOC_END;
+}
+
+void *vmalloc(size_t size)
+{
+	return __vmalloc(size, VM_GUARD);
+}
+
+void *__vmalloc(size_t size, _u32 flags)
+{
+	vm_area_t *area;
+	size_t npg, n;
+	void *page;
+	_u32 va, pfn;
+
+	if (size == 0)
+		return NULL;
+	npg = PAGE_CONTAIN(size);
+
+	area = get_vm_area(npg + ((flags & VM_GUARD) ? 1 : 0), flags);
+	if (area == NULL)
+		return NULL;
+
+	// frames need not be contiguous, prefer those only reachable through
+	// page tables and keep the direct map for others
+	for (n = 0, va = area->addr; n < npg; n++, va += PAGE_SIZE) {
+		// high frames come by number, direct mapped ones by address
+		pfn = get_free_pfn_high();
+		if (pfn != 0) {
+			if (page_map_pfn((void *)va, pfn, k_pdir)) {
+				free_pfn_high(pfn);
+				goto err;
+			}
+			continue;
+		}
+		page = get_free_page();
+		if (page == NULL)
+			goto err;
+		if (page_map((void *)va, (void *)__virt_to_phys(k_pdir,
+							 (_u32) page),
+			     k_pdir, NULL)) {
+			free_pages(page);
+			goto err;
+		}
+	}
+
+	return (void *)area->addr;
+
+      err:
+	log_warn(LOG_MM "vmalloc %d page(s) failed\n", npg);
+	vfree((void *)area->addr);
+	return NULL;
+}
+
+void vfree(void *addr)
+{
+	vm_area_t *area;
+
+	if (addr == NULL)
+		return;
+
+	spin_lock(&vm_lock);
+	list_for_each_entry(area, &vm_areas, list) {
+		if (area->addr == (_u32) addr) {
+			list_del(&area->list);
+			spin_unlock(&vm_lock);
+
+			free_vm_pages(area->addr, area->npg);
+			kfree(area);
+			return;
+		}
+	}
+	spin_unlock(&vm_lock);
+
+	log_err(LOG_MM "vfree bad address 0x%08X\n", addr);
+}
+
+// first fit gap in the window, the area is linked before any page is mapped
+static vm_area_t *get_vm_area(size_t npg, _u32 flags)
+{
+	vm_area_t *area, *newp;
+	_u32 addr = VMALLOC_START;
+
+	newp = kmalloc(sizeof(vm_area_t));
+	if (newp == NULL)
+		return NULL;
+	newp->npg = npg;
+	newp->flags = flags;
+
+	spin_lock(&vm_lock);
+	list_for_each_entry(area, &vm_areas, list) {
+		if (area->addr - addr >= npg * PAGE_SIZE)
+			break;
+		addr = area->addr + area->npg * PAGE_SIZE;
+	}
+	if (VMALLOC_END - addr < npg * PAGE_SIZE) {
+		spin_unlock(&vm_lock);
+		kfree(newp);
+		return NULL;
+	}
+
+	newp->addr = addr;
+	// add before the area found or at the tail if none
+	list_add_tail(&newp->list, &area->list);
+	spin_unlock(&vm_lock);
+
+	return newp;
+}
+
+// unmap and free frames of the area, the guard page has no frame
+static void free_vm_pages(_u32 addr, size_t npg)
+{
+	page_entry_t *ptep;
+	_u32 pfn;
+	size_t n;
+
+	for (n = 0; n < npg; n++, addr += PAGE_SIZE) {
+		ptep = get_page_entry((void *)addr, k_pdir);
+		if (ptep == NULL || !((_u32) * ptep & PAGE_PRESENT))
+			continue;
+
+		pfn = (_u32) ((*ptep & PTE_ADDR_MASK) >> 12);
+		page_unmap((void *)addr, k_pdir);
+		if (pfn < 0x100000 && (pfn << 12) < get_high_mem_start())
+			free_pages((void *)__phys_to_virt_lm(NULL, pfn << 12));
+		else
+			free_pfn_high(pfn);
+	}
+
+	// kernel mappings are shared by all processors
+	smp_flush_tlb_others();
+}